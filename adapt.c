@@ -0,0 +1,147 @@
+/*
+ *  Adaptive repeat interval
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  All numbers are extracted from each response, and compared to those of
+ *  the previous response.  If any of them changed by more than the threshold
+ *  (absolute, or relative when given as a percentage), the interval is
+ *  halved, down to the minimum.  Otherwise it grows by a quarter, up to the
+ *  maximum, so the rate backs off slowly when the signal is stable.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mcuxeq.h"
+#include "adapt.h"
+
+static int adapt_on;
+static double adapt_threshold;
+static int adapt_relative;
+static int adapt_min, adapt_max;
+
+static double *adapt_values;
+static unsigned int adapt_nvalues, adapt_size;
+static int adapt_primed;
+
+void adapt_init(const char *threshold, int min, int max)
+{
+	char *end;
+
+	adapt_threshold = strtod(threshold, &end);
+	if (*end == '%') {
+		adapt_relative = 1;
+		adapt_threshold /= 100;
+		end++;
+	}
+	if (end == threshold || *end || adapt_threshold < 0) {
+		pr_err("Invalid threshold %s\n", threshold);
+		exit(-1);
+	}
+
+	if (min <= 0 || max < min) {
+		pr_err("Invalid interval range %d-%d ms\n", min, max);
+		exit(-1);
+	}
+
+	adapt_min = min;
+	adapt_max = max;
+	adapt_on = 1;
+}
+
+int adapt_enabled(void)
+{
+	return adapt_on;
+}
+
+static double absdiff(double a, double b)
+{
+	return a > b ? a - b : b - a;
+}
+
+static int is_number(const char *buf, const char *p)
+{
+	// Skip digits that are part of identifiers, e.g. "r12"
+	if (p > buf && (isalnum((unsigned char)p[-1]) || p[-1] == '_'))
+		return 0;
+
+	if (*p == '-' || *p == '+')
+		p++;
+	if (*p == '.')
+		p++;
+
+	return isdigit((unsigned char)*p);
+}
+
+/* The response is NUL-terminated, as returned by open_memstream() */
+int adapt_update(int interval, const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len;
+	unsigned int i = 0, changed = 0;
+	char *next;
+	double v;
+
+	while (p < end) {
+		if (!is_number(buf, p)) {
+			p++;
+			continue;
+		}
+
+		v = strtod(p, &next);
+		p = next;
+
+		if (i >= adapt_size) {
+			adapt_size = adapt_size * 2 + 16;
+			adapt_values = realloc(adapt_values, adapt_size *
+							     sizeof(*adapt_values));
+			if (!adapt_values) {
+				pr_err("Failed to allocate buffer: %s\n",
+				       strerror(errno));
+				exit(-1);
+			}
+		}
+
+		if (i >= adapt_nvalues ||
+		    absdiff(v, adapt_values[i]) >
+		    (adapt_relative ? adapt_threshold *
+				      absdiff(adapt_values[i], 0)
+				    : adapt_threshold))
+			changed = 1;
+		adapt_values[i++] = v;
+	}
+	if (i != adapt_nvalues)
+		changed = 1;
+	adapt_nvalues = i;
+
+	// The first response has nothing to compare with
+	if (!adapt_primed) {
+		adapt_primed = 1;
+		changed = 0;
+	} else if (changed) {
+		interval /= 2;
+	} else {
+		interval += interval / 4 + 1;
+	}
+
+	if (interval < adapt_min)
+		interval = adapt_min;
+	if (interval > adapt_max)
+		interval = adapt_max;
+
+	pr_debug("%s, interval %d ms\n", changed ? "Changed" : "Stable",
+		 interval);
+	return interval;
+}
+
+const char *adapt_format_rate(char *buf, size_t size, int interval)
+{
+	snprintf(buf, size, "%.2fHz", interval > 0 ? 1000.0 / interval : 0);
+
+	return buf;
+}
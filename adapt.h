@@ -0,0 +1,20 @@
+/*
+ *  Adaptive repeat interval
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include <stddef.h>
+
+extern void adapt_init(const char *threshold, int min, int max);
+extern int adapt_enabled(void);
+extern int adapt_update(int interval, const char *buf, size_t len);
+extern const char *adapt_format_rate(char *buf, size_t size, int interval);
+
+#endif /* ADAPT_H */
@@ -0,0 +1,190 @@
+/*
+ *  Discovery of the maximum sustainable command rate
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  A command is executed repeatedly on a single open session, in steps of
+ *  increasing rate.  A step fails on deadline misses (a response completing
+ *  after the next command is due), growth of the median latency compared to
+ *  the first step, or a timeout or link error.  Each step runs in a child
+ *  process sharing the port, so a failing step cannot take down the session.
+ *  The interval of the last good step, plus headroom, is stored in the
+ *  device's profile, and used as the minimum interval for repeating the
+ *  command.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "mcuxeq.h"
+#include "calib.h"
+#include "hist.h"
+#include "profile.h"
+#include "trace.h"
+
+#define CALIB_START_MS		100
+#define CALIB_MAX_STEPS		64
+#define CALIB_RAMP		25	/* Rate increase per step (%) */
+#define CALIB_MAX_MISSES	2	/* Deadline misses per step (%), */
+					/* a single one is always tolerated */
+#define CALIB_MAX_GROWTH	50	/* Median latency increase (%) */
+#define CALIB_MIN_INTERVAL_NS	(10 * NSEC_PER_USEC)
+
+/* Shared with the child running the step */
+struct calib_step {
+	struct hist latency;
+	unsigned int misses;
+};
+
+static void calib_step(int fd, const char *cmd, size_t len, uint64_t interval,
+		       unsigned int count, struct calib_step *step, FILE *null)
+{
+	uint64_t next, start, end;
+	unsigned int i;
+
+	next = get_time_ns();
+	for (i = 0; i < count; i++) {
+		start = get_time_ns();
+		if (next > start) {
+			sleep_until(next);
+			start = get_time_ns();
+		} else {
+			next = start;
+		}
+
+		mcu_cmd(fd, cmd, len, null);
+		end = get_time_ns();
+
+		hist_add(&step->latency, end - start);
+		next += interval;
+		if (end > next)
+			step->misses++;
+	}
+}
+
+int calib_run(const char *dev, const char *cmd, size_t len,
+	      unsigned int count, unsigned int headroom)
+{
+	char ival[16], median[16], p99[16], value[LINE_SIZE];
+	uint64_t interval, best = 0, baseline = 0, mid;
+	struct calib_step *step;
+	const char *reason = NULL;
+	unsigned int i;
+	int fd, status;
+	size_t n;
+	pid_t pid;
+	FILE *null;
+
+	// The command is stored on a single line of the profile
+	for (n = len; n && (cmd[n - 1] == '\n' || cmd[n - 1] == '\r'); n--)
+		;
+	if (memchr(cmd, '\n', n) || memchr(cmd, '\r', n)) {
+		pr_err("Cannot calibrate a multi-line command\n");
+		exit(-1);
+	}
+
+	// A single command per step cannot miss a deadline
+	if (count < 2) {
+		pr_err("Invalid count %u, calibration needs at least 2\n",
+		       count);
+		exit(-1);
+	}
+
+	step = mmap(NULL, sizeof(*step), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (step == MAP_FAILED) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	null = fopen("/dev/null", "w");
+	if (!null) {
+		pr_err("Failed to open /dev/null: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	interval = (opt_interval > 0 ? opt_interval : CALIB_START_MS) *
+		   NSEC_PER_MSEC;
+	fd = mcu_open(dev);
+
+	pr_info("Interval      Rate   Median      P99  Misses  Result\n");
+	for (i = 0; i < CALIB_MAX_STEPS && interval >= CALIB_MIN_INTERVAL_NS;
+	     i++) {
+		memset(step, 0, sizeof(*step));
+
+		// Don't duplicate pending output in the child
+		fflush(stdout);
+		fflush(stderr);
+
+		pid = fork();
+		if (pid < 0) {
+			pr_err("Failed to fork: %s\n", strerror(errno));
+			exit(-1);
+		}
+		if (!pid) {
+			calib_step(fd, cmd, len, interval, count, step, null);
+			// The parent still owns the port in the statistics
+			trace_flush();
+			_exit(0);
+		}
+
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			continue;
+
+		mid = hist_quantile(&step->latency, 500);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			reason = "timeout or link error";
+		else if (step->misses > 1 &&
+			 step->misses * 100 > count * CALIB_MAX_MISSES)
+			reason = "deadline misses";
+		else if (i && mid * 100 > baseline * (100 + CALIB_MAX_GROWTH))
+			reason = "latency growth";
+
+		pr_info("%8s %8.1f/s %8s %8s %3u/%-3u  %s\n",
+			format_ns(ival, sizeof(ival), interval),
+			(double)NSEC_PER_SEC / interval,
+			format_ns(median, sizeof(median), mid),
+			format_ns(p99, sizeof(p99),
+				  hist_quantile(&step->latency, 990)),
+			step->misses, count, reason ? reason : "ok");
+		if (reason)
+			break;
+
+		if (!i)
+			baseline = mid;
+		best = interval;
+		interval = interval * 100 / (100 + CALIB_RAMP);
+	}
+
+	mcu_close(fd);
+	fclose(null);
+	munmap(step, sizeof(*step));
+
+	if (!best) {
+		pr_err("Not sustainable at the start interval, try a larger --interval\n");
+		return 1;
+	}
+
+	if (!reason)
+		pr_info("Limit not reached\n");
+	pr_info("Maximum sustainable rate: %.1f/s\n",
+		(double)NSEC_PER_SEC / best);
+
+	best = best * (100 + headroom) / 100;
+	snprintf(value, sizeof(value), "%llu.%03llu %.*s",
+		 best / NSEC_PER_MSEC, (best % NSEC_PER_MSEC) / NSEC_PER_USEC,
+		 (int)n, cmd);
+	profile_store(dev, "min-interval", value);
+	pr_info("Stored min-interval %s (%u%% headroom) in profile\n", value,
+		headroom);
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ *  Discovery of the maximum sustainable command rate
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <stddef.h>
+
+#define DEFAULT_CALIB_COUNT	50	/* Commands per step */
+
+extern int calib_run(const char *dev, const char *cmd, size_t len,
+		     unsigned int count, unsigned int headroom);
+
+#endif /* CALIB_H */
@@ -0,0 +1,284 @@
+/*
+ *  Differential configuration upload
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  A configuration file consists of commands, one per line.  The last
+ *  configuration pushed to a device is cached, and only lines that are not
+ *  in the cache are sent, pipelined in a single session.  If a check command
+ *  is given (e.g. one printing a checksum of the device's configuration),
+ *  its output is cached too, and a mismatch invalidates the cache, forcing
+ *  a full upload.  Lines whose response matches the reject pattern are not
+ *  cached, so they are sent again next time.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <regex.h>
+#include <string.h>
+
+#include "mcuxeq.h"
+#include "config.h"
+#include "profile.h"
+
+#define CONFIG_CHECK_TAG	"#check "
+
+struct config {
+	char **lines;			/* Including the newline */
+	size_t *lens;
+	unsigned int nlines;
+	char *check;			/* Check command output */
+};
+
+struct config_upload {
+	regex_t reject;
+	struct config *cfg;
+	const unsigned int *idx;	/* Line of each command sent */
+	unsigned int next;		/* Next response */
+	unsigned int nrejected;
+};
+
+static void *config_alloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	return p;
+}
+
+static void config_free(struct config *cfg)
+{
+	unsigned int i;
+
+	for (i = 0; i < cfg->nlines; i++)
+		free(cfg->lines[i]);
+	free(cfg->lines);
+	free(cfg->lens);
+	free(cfg->check);
+	memset(cfg, 0, sizeof(*cfg));
+}
+
+/* Returns -1 if the file does not exist */
+static int config_load(struct config *cfg, const char *pathname, int cache)
+{
+	size_t size = 0, checksize;
+	FILE *f, *check = NULL;
+	char *line = NULL;
+	ssize_t len;
+
+	memset(cfg, 0, sizeof(*cfg));
+
+	f = fopen(pathname, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return -1;
+		pr_err("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	if (cache) {
+		check = open_memstream(&cfg->check, &checksize);
+		if (!check) {
+			pr_err("Failed to allocate buffer: %s\n",
+			       strerror(errno));
+			exit(-1);
+		}
+	}
+
+	while ((len = getline(&line, &size, f)) > 0) {
+		len = strcspn(line, "\r\n");
+		if (cache && !strncmp(line, CONFIG_CHECK_TAG,
+				      strlen(CONFIG_CHECK_TAG))) {
+			fprintf(check, "%.*s\n",
+				(int)(len - strlen(CONFIG_CHECK_TAG)),
+				line + strlen(CONFIG_CHECK_TAG));
+			continue;
+		}
+		if (!len || line[0] == '#')
+			continue;
+
+		line[len++] = '\n';
+		line[len] = '\0';
+
+		cfg->lines = config_alloc(cfg->lines, (cfg->nlines + 1) *
+						      sizeof(*cfg->lines));
+		cfg->lens = config_alloc(cfg->lens, (cfg->nlines + 1) *
+						    sizeof(*cfg->lens));
+		cfg->lines[cfg->nlines] = strdup(line);
+		cfg->lens[cfg->nlines++] = len;
+	}
+
+	free(line);
+	if (check)
+		fclose(check);
+	fclose(f);
+
+	return 0;
+}
+
+static void config_save(const struct config *cfg, const char *pathname)
+{
+	char tmp[PATH_MAX + 4];
+	const char *p, *nl;
+	unsigned int i;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", pathname);
+	f = fopen(tmp, "w");
+	if (!f) {
+		pr_err("Failed to create %s: %s\n", tmp, strerror(errno));
+		exit(-1);
+	}
+
+	for (p = cfg->check; p && *p; p = nl + 1) {
+		nl = strchrnul(p, '\n');
+		fprintf(f, CONFIG_CHECK_TAG "%.*s\n", (int)(nl - p), p);
+		if (!*nl)
+			break;
+	}
+	for (i = 0; i < cfg->nlines; i++)
+		if (cfg->lines[i])
+			fputs(cfg->lines[i], f);
+
+	if (fclose(f) || rename(tmp, pathname)) {
+		pr_err("Failed to write %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+}
+
+static char *config_check(int fd, const char *check)
+{
+	char cmd[LINE_SIZE], *buf;
+	size_t size;
+	FILE *out;
+	int n;
+
+	n = snprintf(cmd, sizeof(cmd), "%s\n", check);
+	if (n >= sizeof(cmd)) {
+		pr_err("Check command too long\n");
+		exit(-1);
+	}
+
+	out = open_memstream(&buf, &size);
+	if (!out) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	mcu_cmd(fd, cmd, n, out);
+	fclose(out);
+
+	return buf;
+}
+
+static void config_record(uint64_t ts, const char *buf, size_t len,
+			  void *arg)
+{
+	struct config_upload *up = arg;
+	unsigned int i = up->idx[up->next++];
+
+	fwrite(buf, 1, len, stdout);
+	if (regexec(&up->reject, buf, 0, NULL, 0))
+		return;
+
+	// Drop the line from the cache, so it is sent again next time
+	pr_err("Rejected: %s", up->cfg->lines[i]);
+	free(up->cfg->lines[i]);
+	up->cfg->lines[i] = NULL;
+	up->nrejected++;
+}
+
+static int config_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int config_run(const char *dev, const char *pathname, const char *check,
+	       const char *reject, unsigned int window)
+{
+	struct config cfg, old;
+	struct config_upload up = { .cfg = &cfg };
+	const char **send;
+	unsigned int *idx;
+	size_t *lens;
+	char cache[PATH_MAX], *check_out;
+	unsigned int i, n;
+	int fd, full, ret;
+
+	ret = regcomp(&up.reject, reject, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+	if (ret) {
+		char errbuf[256];
+
+		regerror(ret, &up.reject, errbuf, sizeof(errbuf));
+		pr_err("Failed to compile reject regex: %s\n", errbuf);
+		exit(-1);
+	}
+
+	if (config_load(&cfg, pathname, 0)) {
+		pr_err("Failed to open %s: %s\n", pathname, strerror(ENOENT));
+		exit(-1);
+	}
+
+	dev_file_name(cache, sizeof(cache), "XDG_CACHE_HOME", ".cache", dev,
+		      ".conf", 1);
+	full = config_load(&old, cache, 1);
+
+	fd = mcu_open(dev);
+
+	if (!full && check) {
+		check_out = config_check(fd, check);
+		if (strcmp(check_out, old.check)) {
+			pr_err("Configuration changed on device\n");
+			full = 1;
+		}
+		free(check_out);
+	}
+
+	if (full)
+		config_free(&old);
+	qsort(old.lines, old.nlines, sizeof(*old.lines), config_cmp);
+
+	send = config_alloc(NULL, (cfg.nlines + 1) * sizeof(*send));
+	lens = config_alloc(NULL, (cfg.nlines + 1) * sizeof(*lens));
+	idx = config_alloc(NULL, (cfg.nlines + 1) * sizeof(*idx));
+	for (i = 0, n = 0; i < cfg.nlines; i++) {
+		if (old.nlines &&
+		    bsearch(&cfg.lines[i], old.lines, old.nlines,
+			    sizeof(*old.lines), config_cmp))
+			continue;
+		send[n] = cfg.lines[i];
+		idx[n] = i;
+		lens[n++] = cfg.lens[i];
+	}
+
+	up.idx = idx;
+	mcu_pipeline(fd, send, lens, n, window, config_record, &up);
+
+	if (check)
+		cfg.check = config_check(fd, check);
+
+	mcu_close(fd);
+
+	config_save(&cfg, cache);
+
+	fflush(stdout);
+	pr_err("%u of %u lines sent%s, %u rejected\n", n, cfg.nlines,
+	       full ? " (full upload)" : "", up.nrejected);
+
+	free(idx);
+	free(lens);
+	free(send);
+	config_free(&old);
+	config_free(&cfg);
+	regfree(&up.reject);
+
+	return up.nrejected ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+/*
+ *  Differential configuration upload
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define DEFAULT_WINDOW		8
+#define DEFAULT_REJECT		"error|invalid|unknown|usage"
+
+extern int config_run(const char *dev, const char *pathname,
+		      const char *check, const char *reject,
+		      unsigned int window);
+
+#endif /* CONFIG_H */
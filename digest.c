@@ -0,0 +1,516 @@
+/*
+ *  Streaming response digests
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  Responses are hashed while they are received, through an unbuffered
+ *  stream, so large responses (e.g. firmware readbacks) can be verified
+ *  without storing them.  Supported algorithms are CRC-32C (Castagnoli),
+ *  XXH64 (seed 0), and SHA-256.  If the expected size is known, writes fail
+ *  as soon as a response grows beyond it, so the command can be stopped.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mcuxeq.h"
+#include "digest.h"
+
+#define DIGEST_MAX_SIZE		32
+
+struct digest_algo {
+	const char *name;
+	void (*init)(void *ctx);
+	void (*update)(void *ctx, const uint8_t *buf, size_t len);
+	size_t (*final)(void *ctx, uint8_t *out);
+};
+
+struct digest {
+	const struct digest_algo *algo;
+	unsigned long long size;
+	unsigned long long expect_size;
+	union {
+		uint32_t crc;
+		struct xxh64 {
+			uint64_t v[4];
+			uint8_t buf[32];
+			size_t buflen;
+			uint64_t len;
+		} xxh64;
+		struct sha256 {
+			uint32_t h[8];
+			uint8_t buf[64];
+			size_t buflen;
+			uint64_t len;
+		} sha256;
+	} ctx;
+};
+
+/* CRC-32C */
+
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void *ctx)
+{
+	unsigned int i, j;
+	uint32_t c;
+
+	if (!crc32c_table[1]) {
+		for (i = 0; i < 256; i++) {
+			for (c = i, j = 0; j < 8; j++)
+				c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+			crc32c_table[i] = c;
+		}
+	}
+
+	*(uint32_t *)ctx = 0xffffffff;
+}
+
+static void crc32c_update(void *ctx, const uint8_t *buf, size_t len)
+{
+	uint32_t c = *(uint32_t *)ctx;
+
+	while (len--)
+		c = crc32c_table[(c ^ *buf++) & 0xff] ^ (c >> 8);
+
+	*(uint32_t *)ctx = c;
+}
+
+static size_t crc32c_final(void *ctx, uint8_t *out)
+{
+	uint32_t c = *(uint32_t *)ctx ^ 0xffffffff;
+
+	out[0] = c >> 24;
+	out[1] = c >> 16;
+	out[2] = c >> 8;
+	out[3] = c;
+
+	return 4;
+}
+
+/* XXH64 */
+
+#define XXH_P1			0x9e3779b185ebca87ULL
+#define XXH_P2			0xc2b2ae3d27d4eb4fULL
+#define XXH_P3			0x165667b19e3779f9ULL
+#define XXH_P4			0x85ebca77c2b2ae63ULL
+#define XXH_P5			0x27d4eb2f165667c5ULL
+
+static inline uint64_t rotl64(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+	       (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 |
+	       (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 |
+	       (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static void xxh64_init(void *ctx)
+{
+	struct xxh64 *x = ctx;
+
+	memset(x, 0, sizeof(*x));
+	x->v[0] = XXH_P1 + XXH_P2;
+	x->v[1] = XXH_P2;
+	x->v[2] = 0;
+	x->v[3] = -XXH_P1;
+}
+
+static void xxh64_stripe(struct xxh64 *x, const uint8_t *p)
+{
+	x->v[0] = xxh64_round(x->v[0], get_le64(p));
+	x->v[1] = xxh64_round(x->v[1], get_le64(p + 8));
+	x->v[2] = xxh64_round(x->v[2], get_le64(p + 16));
+	x->v[3] = xxh64_round(x->v[3], get_le64(p + 24));
+}
+
+static void xxh64_update(void *ctx, const uint8_t *buf, size_t len)
+{
+	struct xxh64 *x = ctx;
+	size_t n;
+
+	x->len += len;
+
+	if (x->buflen) {
+		n = sizeof(x->buf) - x->buflen < len ?
+		    sizeof(x->buf) - x->buflen : len;
+		memcpy(x->buf + x->buflen, buf, n);
+		x->buflen += n;
+		buf += n;
+		len -= n;
+		if (x->buflen < sizeof(x->buf))
+			return;
+		xxh64_stripe(x, x->buf);
+		x->buflen = 0;
+	}
+
+	for (; len >= 32; buf += 32, len -= 32)
+		xxh64_stripe(x, buf);
+
+	memcpy(x->buf, buf, len);
+	x->buflen = len;
+}
+
+static size_t xxh64_final(void *ctx, uint8_t *out)
+{
+	struct xxh64 *x = ctx;
+	const uint8_t *p = x->buf, *end = x->buf + x->buflen;
+	unsigned int i;
+	uint64_t h;
+
+	if (x->len >= 32) {
+		h = rotl64(x->v[0], 1) + rotl64(x->v[1], 7) +
+		    rotl64(x->v[2], 12) + rotl64(x->v[3], 18);
+		for (i = 0; i < 4; i++)
+			h = (h ^ xxh64_round(0, x->v[i])) * XXH_P1 + XXH_P4;
+	} else {
+		h = XXH_P5;
+	}
+	h += x->len;
+
+	for (; p + 8 <= end; p += 8)
+		h = rotl64(h ^ xxh64_round(0, get_le64(p)), 27) * XXH_P1 +
+		    XXH_P4;
+	if (p + 4 <= end) {
+		h = rotl64(h ^ get_le32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+
+	for (i = 0; i < 8; i++)
+		out[i] = h >> (56 - 8 * i);
+
+	return 8;
+}
+
+/* XXH32 */
+
+#define XXH32_P1		0x9e3779b1U
+#define XXH32_P2		0x85ebca77U
+#define XXH32_P3		0xc2b2ae3dU
+#define XXH32_P4		0x27d4eb2fU
+#define XXH32_P5		0x165667b1U
+
+static inline uint32_t rotl32(uint32_t x, unsigned int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t xxh32_round(uint32_t acc, uint32_t input)
+{
+	return rotl32(acc + input * XXH32_P2, 13) * XXH32_P1;
+}
+
+void xxh32_init(struct xxh32 *x)
+{
+	memset(x, 0, sizeof(*x));
+	x->v[0] = XXH32_P1 + XXH32_P2;
+	x->v[1] = XXH32_P2;
+	x->v[2] = 0;
+	x->v[3] = -XXH32_P1;
+}
+
+static void xxh32_stripe(struct xxh32 *x, const uint8_t *p)
+{
+	x->v[0] = xxh32_round(x->v[0], get_le32(p));
+	x->v[1] = xxh32_round(x->v[1], get_le32(p + 4));
+	x->v[2] = xxh32_round(x->v[2], get_le32(p + 8));
+	x->v[3] = xxh32_round(x->v[3], get_le32(p + 12));
+}
+
+void xxh32_update(struct xxh32 *x, const uint8_t *buf, size_t len)
+{
+	size_t n;
+
+	x->len += len;
+
+	if (x->buflen) {
+		n = sizeof(x->buf) - x->buflen < len ?
+		    sizeof(x->buf) - x->buflen : len;
+		memcpy(x->buf + x->buflen, buf, n);
+		x->buflen += n;
+		buf += n;
+		len -= n;
+		if (x->buflen < sizeof(x->buf))
+			return;
+		xxh32_stripe(x, x->buf);
+		x->buflen = 0;
+	}
+
+	for (; len >= 16; buf += 16, len -= 16)
+		xxh32_stripe(x, buf);
+
+	memcpy(x->buf, buf, len);
+	x->buflen = len;
+}
+
+uint32_t xxh32_final(const struct xxh32 *x)
+{
+	const uint8_t *p = x->buf, *end = x->buf + x->buflen;
+	uint32_t h;
+
+	if (x->len >= 16)
+		h = rotl32(x->v[0], 1) + rotl32(x->v[1], 7) +
+		    rotl32(x->v[2], 12) + rotl32(x->v[3], 18);
+	else
+		h = XXH32_P5;
+	h += x->len;
+
+	for (; p + 4 <= end; p += 4)
+		h = rotl32(h + get_le32(p) * XXH32_P3, 17) * XXH32_P4;
+	for (; p < end; p++)
+		h = rotl32(h + *p * XXH32_P5, 11) * XXH32_P1;
+
+	h ^= h >> 15;
+	h *= XXH32_P2;
+	h ^= h >> 13;
+	h *= XXH32_P3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/* SHA-256 */
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr32(uint32_t x, unsigned int r)
+{
+	return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_init(void *ctx)
+{
+	static const uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	struct sha256 *s = ctx;
+
+	memset(s, 0, sizeof(*s));
+	memcpy(s->h, h, sizeof(h));
+}
+
+static void sha256_block(struct sha256 *s, const uint8_t *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 |
+		       p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+			(w[i - 15] >> 3)) +
+		       (rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+			(w[i - 2] >> 10));
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256_update(void *ctx, const uint8_t *buf, size_t len)
+{
+	struct sha256 *s = ctx;
+	size_t n;
+
+	s->len += len;
+
+	while (len) {
+		n = sizeof(s->buf) - s->buflen < len ?
+		    sizeof(s->buf) - s->buflen : len;
+		if (n == sizeof(s->buf)) {
+			// Full block, skip the copy
+			sha256_block(s, buf);
+		} else {
+			memcpy(s->buf + s->buflen, buf, n);
+			s->buflen += n;
+			if (s->buflen == sizeof(s->buf)) {
+				sha256_block(s, s->buf);
+				s->buflen = 0;
+			}
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static size_t sha256_final(void *ctx, uint8_t *out)
+{
+	struct sha256 *s = ctx;
+	uint64_t bits = s->len * 8;
+	unsigned int i;
+
+	s->buf[s->buflen++] = 0x80;
+	if (s->buflen > 56) {
+		memset(s->buf + s->buflen, 0, sizeof(s->buf) - s->buflen);
+		sha256_block(s, s->buf);
+		s->buflen = 0;
+	}
+	memset(s->buf + s->buflen, 0, 56 - s->buflen);
+	for (i = 0; i < 8; i++)
+		s->buf[56 + i] = bits >> (56 - 8 * i);
+	sha256_block(s, s->buf);
+
+	for (i = 0; i < 32; i++)
+		out[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+
+	return 32;
+}
+
+static const struct digest_algo digest_algos[] = {
+	{ "crc32c", crc32c_init, crc32c_update, crc32c_final },
+	{ "xxhash", xxh64_init, xxh64_update, xxh64_final },
+	{ "sha256", sha256_init, sha256_update, sha256_final },
+};
+
+static struct digest *digest;
+
+static ssize_t digest_write(void *cookie, const char *buf, size_t len)
+{
+	struct digest *d = cookie;
+
+	d->size += len;
+	if (d->expect_size && d->size > d->expect_size) {
+		// Known mismatch, fail the write to stop the command.  Not -1,
+		// which fwrite() adds to the number of bytes written
+		errno = EFBIG;
+		return 0;
+	}
+
+	d->algo->update(&d->ctx, (const uint8_t *)buf, len);
+
+	return len;
+}
+
+/* Returns an unbuffered stream hashing all data written to it */
+FILE *digest_open(const char *algo, unsigned long long expect_size)
+{
+	cookie_io_functions_t io = { .write = digest_write };
+	unsigned int i;
+	FILE *f;
+
+	for (i = 0; i < sizeof(digest_algos) / sizeof(*digest_algos); i++)
+		if (!strcmp(digest_algos[i].name, algo))
+			break;
+	if (i == sizeof(digest_algos) / sizeof(*digest_algos)) {
+		pr_err("Unknown digest %s\n", algo);
+		exit(-1);
+	}
+
+	digest = calloc(1, sizeof(*digest));
+	if (!digest) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	digest->algo = &digest_algos[i];
+	digest->expect_size = expect_size;
+	digest->algo->init(&digest->ctx);
+
+	f = fopencookie(digest, "w", io);
+	if (!f) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	setvbuf(f, NULL, _IONBF, 0);
+
+	return f;
+}
+
+/*
+ * Print the digest, or the result of comparing it to the expected digest.
+ * Returns zero on match.
+ */
+int digest_close(FILE *f, const char *expect)
+{
+	char hex[2 * DIGEST_MAX_SIZE + 1];
+	uint8_t out[DIGEST_MAX_SIZE];
+	struct digest *d = digest;
+	size_t i, n;
+
+	fclose(f);
+	digest = NULL;
+
+	n = d->algo->final(&d->ctx, out);
+	for (i = 0; i < n; i++)
+		sprintf(hex + 2 * i, "%02x", out[i]);
+
+	if (d->expect_size && d->size > d->expect_size) {
+		pr_info("Mismatch: response larger than %llu bytes\n",
+			d->expect_size);
+		free(d);
+		return 1;
+	}
+	if (d->expect_size && d->size < d->expect_size) {
+		pr_info("Mismatch: response has %llu of %llu bytes\n",
+			d->size, d->expect_size);
+		free(d);
+		return 1;
+	}
+
+	if (!expect) {
+		pr_info("%s %s\n", d->algo->name, hex);
+		free(d);
+		return 0;
+	}
+
+	i = strcasecmp(hex, expect);
+	pr_info("%s\n", i ? "Mismatch" : "OK");
+	free(d);
+
+	return i ? 1 : 0;
+}
@@ -0,0 +1,31 @@
+/*
+ *  Streaming response digests
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* XXH32 (seed 0), as used by the LZ4 frame format */
+struct xxh32 {
+	uint32_t v[4];
+	uint8_t buf[16];
+	size_t buflen;
+	uint64_t len;
+};
+
+extern void xxh32_init(struct xxh32 *x);
+extern void xxh32_update(struct xxh32 *x, const uint8_t *buf, size_t len);
+extern uint32_t xxh32_final(const struct xxh32 *x);
+
+extern FILE *digest_open(const char *algo, unsigned long long expect_size);
+extern int digest_close(FILE *f, const char *expect);
+
+#endif /* DIGEST_H */
@@ -0,0 +1,293 @@
+/*
+ *  Incremental memory dump
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  The image file doubles as the cache of the previous dump.  For each
+ *  block, the MCU is asked for its CRC-32 (as used by zlib and Ethernet),
+ *  and only blocks that do not match the image are dumped.  Dump responses
+ *  are expected as lines of the form "<hex address>: <hex bytes>", with the
+ *  number of bytes given by the address of the next line, so any trailing
+ *  ASCII column is ignored.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "mcuxeq.h"
+#include "dump.h"
+
+#define DUMP_CMD_SIZE		256
+
+static uint32_t crc32_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t c;
+	unsigned int i, j;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+static uint32_t crc32(const uint8_t *buf, size_t len)
+{
+	uint32_t c = 0xffffffff;
+
+	while (len--)
+		c = crc32_table[(c ^ *buf++) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffff;
+}
+
+/*
+ * Commands are printf() formats, so only accept exactly two conversions of
+ * an unsigned long, i.e. the address and size, besides literal "%%"
+ */
+void dump_check_fmt(const char *opt, const char *fmt)
+{
+	const char *p = fmt;
+	unsigned int n = 0;
+
+	for (; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (*++p == '%')
+			continue;
+		p += strspn(p, "#0- +");
+		p += strspn(p, "0123456789");
+		if (*p == '.')
+			p += 1 + strspn(p + 1, "0123456789");
+		if (p[0] != 'l' || !p[1] || !strchr("diouxX", p[1]))
+			goto invalid;
+		p++;
+		n++;
+	}
+
+	if (n == 2)
+		return;
+
+invalid:
+	pr_err("Invalid %s \"%s\", need two %%lx or %%lu conversions\n", opt,
+	       fmt);
+	exit(-1);
+}
+
+static char *dump_query(int fd, const char *fmt, unsigned long addr,
+			unsigned long len)
+{
+	char cmd[DUMP_CMD_SIZE];
+	size_t size;
+	char *buf;
+	FILE *out;
+	int n;
+
+	n = snprintf(cmd, sizeof(cmd) - 1, fmt, addr, len);
+	if (n < 0 || n >= sizeof(cmd) - 1) {
+		pr_err("Command too long\n");
+		exit(-1);
+	}
+	cmd[n++] = '\n';
+	cmd[n] = '\0';
+
+	out = open_memstream(&buf, &size);
+	if (!out) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	mcu_cmd(fd, cmd, n, out);
+	fclose(out);
+
+	return buf;
+}
+
+/*
+ * The CRC is the last word in the response, as a hexadecimal number, so an
+ * echoed address or size is never mistaken for it
+ */
+static uint32_t dump_crc(int fd, const struct dump_opts *opts,
+			 unsigned long addr, unsigned long len)
+{
+	char *resp, *word, *last = NULL, *save, *end;
+	unsigned long crc;
+
+	resp = dump_query(fd, opts->crc_cmd, addr, len);
+	for (word = strtok_r(resp, " \t\r\n", &save); word;
+	     word = strtok_r(NULL, " \t\r\n", &save))
+		last = word;
+
+	if (last) {
+		crc = strtoul(last, &end, 16);
+		if (end != last && !*end && crc <= 0xffffffff) {
+			free(resp);
+			return crc;
+		}
+	}
+
+	pr_err("%#lx: No CRC in response\n", addr);
+	exit(-1);
+}
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Parses up to n bytes at address a, returns the number of bytes found */
+static unsigned long dump_line(const char *p, unsigned long a,
+			       unsigned long n, unsigned long addr,
+			       unsigned long len, uint8_t *buf)
+{
+	unsigned long i;
+
+	if (a < addr || a >= addr + len || n > addr + len - a) {
+		pr_err("%#lx: Unexpected address\n", a);
+		exit(-1);
+	}
+
+	for (i = 0; i < n; i++, p += 2) {
+		p += strspn(p, " \t");
+		if (hexval(p[0]) < 0 || hexval(p[1]) < 0 ||
+		    isxdigit((unsigned char)p[2]))
+			break;
+		buf[a - addr + i] = hexval(p[0]) << 4 | hexval(p[1]);
+	}
+
+	return i;
+}
+
+/*
+ * The number of bytes on each line follows from the address of the next
+ * line, or the end of the block, so any ASCII column is never parsed, even if
+ * it looks like hexadecimal bytes
+ */
+static void dump_read(int fd, const struct dump_opts *opts,
+		      unsigned long addr, unsigned long len, uint8_t *buf)
+{
+	char *resp, *line, *save, *p, *prev = NULL;
+	unsigned long a, prev_a = 0, got = 0;
+
+	resp = dump_query(fd, opts->read_cmd, addr, len);
+	for (line = strtok_r(resp, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		a = strtoul(line, &p, 16);
+		if (p == line || *p++ != ':')
+			continue;
+
+		if (prev) {
+			if (a <= prev_a) {
+				pr_err("%#lx: Unexpected address\n", a);
+				exit(-1);
+			}
+			got += dump_line(prev, prev_a, a - prev_a, addr, len,
+					 buf);
+		}
+		prev = p;
+		prev_a = a;
+	}
+	if (prev)
+		got += dump_line(prev, prev_a, addr + len - prev_a, addr, len,
+				 buf);
+	free(resp);
+
+	if (got != len) {
+		pr_err("%#lx: Short dump, got %lu of %lu bytes\n", addr, got,
+		       len);
+		exit(-1);
+	}
+}
+
+int dump_run(const char *dev, const char *image, const struct dump_opts *opts)
+{
+	unsigned long size = opts->size, off, n, nblocks = 0, changed = 0;
+	unsigned int errors = 0;
+	uint64_t start;
+	struct stat st;
+	uint8_t *buf;
+	uint32_t crc;
+	char ts[32];
+	int fd, img;
+
+	if (!opts->block) {
+		pr_err("Invalid block size\n");
+		exit(-1);
+	}
+
+	img = open(image, O_RDWR | O_CREAT, 0644);
+	if (img < 0 || fstat(img, &st)) {
+		pr_err("Failed to open %s: %s\n", image, strerror(errno));
+		exit(-1);
+	}
+
+	if (!size)
+		size = st.st_size;
+	if (!size) {
+		pr_err("Unknown dump size\n");
+		exit(-1);
+	}
+
+	buf = malloc(opts->block);
+	if (!buf) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	crc32_init();
+	start = get_time_ns();
+	fd = mcu_open(dev);
+
+	for (off = 0; off < size; off += n, nblocks++) {
+		n = size - off < opts->block ? size - off : opts->block;
+		crc = dump_crc(fd, opts, opts->base + off, n);
+
+		if (pread(img, buf, n, off) == n && crc32(buf, n) == crc)
+			continue;
+
+		pr_debug("%#lx: Block changed\n", opts->base + off);
+		dump_read(fd, opts, opts->base + off, n, buf);
+		if (crc32(buf, n) != crc) {
+			pr_err("%#lx: CRC mismatch after dump\n",
+			       opts->base + off);
+			errors++;
+		}
+
+		if (pwrite(img, buf, n, off) != n) {
+			pr_err("Failed to write %s: %s\n", image,
+			       strerror(errno));
+			exit(-1);
+		}
+		changed++;
+	}
+
+	mcu_close(fd);
+
+	if (st.st_size > size && ftruncate(img, size)) {
+		pr_err("Failed to truncate %s: %s\n", image, strerror(errno));
+		exit(-1);
+	}
+	close(img);
+	free(buf);
+
+	pr_err("%lu of %lu blocks changed, dumped in %s\n", changed, nblocks,
+	       format_ns(ts, sizeof(ts), get_time_ns() - start));
+
+	return errors ? -1 : 0;
+}
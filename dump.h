@@ -0,0 +1,29 @@
+/*
+ *  Incremental memory dump
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef DUMP_H
+#define DUMP_H
+
+#define DEFAULT_DUMP_BLOCK	4096
+#define DEFAULT_CRC_CMD		"crc %#lx %lu"
+#define DEFAULT_READ_CMD	"dump %#lx %lu"
+
+struct dump_opts {
+	unsigned long base;
+	unsigned long size;		/* 0 is size of the image file */
+	unsigned long block;
+	const char *crc_cmd;		/* printf format, with address and size */
+	const char *read_cmd;		/* printf format, with address and size */
+};
+
+extern void dump_check_fmt(const char *opt, const char *fmt);
+extern int dump_run(const char *dev, const char *image,
+		    const struct dump_opts *opts);
+
+#endif /* DUMP_H */
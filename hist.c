@@ -0,0 +1,117 @@
+/*
+ *  Log-linear histograms
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "mcuxeq.h"
+#include "hist.h"
+
+#define HIST_BAR_WIDTH		40
+
+uint64_t hist_lower(unsigned int idx)
+{
+	unsigned int group = idx / HIST_SUB;
+
+	if (!group)
+		return idx;
+
+	return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (group - 1);
+}
+
+uint64_t hist_upper(unsigned int idx)
+{
+	if (idx + 1 >= HIST_BUCKETS)
+		return UINT64_MAX;
+
+	return hist_lower(idx + 1) - 1;
+}
+
+void hist_read(struct hist *dst, const struct hist *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->count[i] = __atomic_load_n(&src->count[i],
+						__ATOMIC_RELAXED);
+}
+
+void hist_sub(struct hist *dst, const struct hist *a, const struct hist *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->count[i] = a->count[i] - b->count[i];
+}
+
+uint64_t hist_total(const struct hist *h)
+{
+	uint64_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += h->count[i];
+
+	return total;
+}
+
+/* Returns the midpoint of the bucket holding the requested quantile */
+uint64_t hist_quantile(const struct hist *h, unsigned int permille)
+{
+	uint64_t total, target, sum = 0;
+	unsigned int i;
+
+	total = hist_total(h);
+	if (!total)
+		return 0;
+
+	target = (total * permille + 999) / 1000;
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += h->count[i];
+		if (sum >= target)
+			break;
+	}
+
+	return hist_lower(i) + (hist_upper(i) - hist_lower(i)) / 2;
+}
+
+const char *hist_format_count(char *buf, size_t size, uint64_t v)
+{
+	snprintf(buf, size, "%" PRIu64, v);
+	return buf;
+}
+
+/* Print all non-empty buckets on stderr, with a bar graph */
+void hist_print(const struct hist *h,
+		const char *(*format)(char *buf, size_t size, uint64_t v))
+{
+	char lo[16], hi[16], bar[HIST_BAR_WIDTH + 1];
+	uint64_t max = 0;
+	unsigned int i, n;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (h->count[i] > max)
+			max = h->count[i];
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!h->count[i])
+			continue;
+
+		n = (h->count[i] * HIST_BAR_WIDTH + max - 1) / max;
+		memset(bar, '#', n);
+		bar[n] = '\0';
+		pr_err("  %10s .. %-10s %10" PRIu64 " %s\n",
+		       format(lo, sizeof(lo), hist_lower(i)),
+		       format(hi, sizeof(hi), hist_upper(i)), h->count[i],
+		       bar);
+	}
+}
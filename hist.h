@@ -0,0 +1,58 @@
+/*
+ *  Log-linear histograms
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each power of two is split in HIST_SUB linear sub-buckets, giving a
+ * relative error below 1 / HIST_SUB over the full 64-bit range.
+ */
+#define HIST_SUB_BITS		3
+#define HIST_SUB		(1U << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+};
+
+static inline unsigned int hist_index(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < HIST_SUB)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	       ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Safe against concurrent updates, e.g. in shared memory */
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+	__atomic_fetch_add(&h->count[hist_index(v)], 1, __ATOMIC_RELAXED);
+}
+
+extern uint64_t hist_lower(unsigned int idx);
+extern uint64_t hist_upper(unsigned int idx);
+extern void hist_read(struct hist *dst, const struct hist *src);
+extern void hist_sub(struct hist *dst, const struct hist *a,
+		     const struct hist *b);
+extern uint64_t hist_total(const struct hist *h);
+extern uint64_t hist_quantile(const struct hist *h, unsigned int permille);
+extern const char *hist_format_count(char *buf, size_t size, uint64_t v);
+extern void hist_print(const struct hist *h,
+		       const char *(*format)(char *buf, size_t size,
+					     uint64_t v));
+
+#endif /* HIST_H */
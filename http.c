@@ -0,0 +1,700 @@
+/*
+ *  Loopback HTTP server for commands and live samples
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  The serial port is kept open for the lifetime of the server, which
+ *  listens on 127.0.0.1 only, and offers:
+ *
+ *      POST /exec                 Execute the command in the request body,
+ *                                 return its response
+ *      GET /events                Server-Sent Events stream, one event per
+ *                                 execution of the periodic command
+ *
+ *  Connections are persistent (HTTP/1.1 keep-alive).  Everything runs in a
+ *  single thread: sockets are non-blocking, and output that cannot be
+ *  written immediately is queued per client.  Events are formatted once,
+ *  and written to all subscribers with writev().  Commands are executed in
+ *  a child process, so they cannot terminate the server.  A failed command
+ *  is stopped using the stop sequence, to resynchronize with the prompt.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "mcuxeq.h"
+#include "http.h"
+#include "trace.h"
+
+#define HTTP_MAX_CLIENTS	32
+#define HTTP_MAX_HEAD		8192
+#define HTTP_MAX_BODY		65536
+#define HTTP_MAX_PENDING	(1 << 20)	/* Drop slower clients */
+#define HTTP_EXEC_TYPE		"application/x-mcuxeq"
+
+struct http_client {
+	int fd;
+	char *in;
+	size_t inlen, insize;
+	char *out;			/* Output not yet written */
+	size_t outlen, outoff;
+	int events;			/* Subscribed to the event stream */
+	int close;			/* Close when output has been written */
+};
+
+/* Header fields checked before executing a command */
+struct http_fields {
+	const char *host, *origin, *site, *type;
+	size_t hostlen, originlen, sitelen, typelen;
+};
+
+static struct http_client http_clients[HTTP_MAX_CLIENTS];
+static int http_ser = -1;
+static int http_port;
+static char *http_last;			/* Last event, for new subscribers */
+static size_t http_last_len;
+
+static void *http_alloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	return p;
+}
+
+static void http_drop(struct http_client *c)
+{
+	pr_debug("HTTP client %d closed\n", c->fd);
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+static void http_queue(struct http_client *c, const char *buf, size_t len)
+{
+	if (c->outoff) {
+		memmove(c->out, c->out + c->outoff, c->outlen - c->outoff);
+		c->outlen -= c->outoff;
+		c->outoff = 0;
+	}
+
+	c->out = http_alloc(c->out, c->outlen + len);
+	memcpy(c->out + c->outlen, buf, len);
+	c->outlen += len;
+}
+
+/* Write pending output followed by new data, queueing what doesn't fit */
+static void http_send(struct http_client *c, const struct iovec *iov,
+		      unsigned int n)
+{
+	struct iovec v[3];		/* Pending output + up to 2 buffers */
+	unsigned int i, nv = 0;
+	size_t pending, total = 0;
+	ssize_t res;
+
+	if (c->outlen > c->outoff) {
+		v[nv].iov_base = c->out + c->outoff;
+		v[nv++].iov_len = c->outlen - c->outoff;
+	}
+	for (i = 0; i < n; i++)
+		v[nv++] = iov[i];
+	for (i = 0; i < nv; i++)
+		total += v[i].iov_len;
+	if (!total)
+		return;
+
+	res = writev(c->fd, v, nv);
+	if (res < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			http_drop(c);
+			return;
+		}
+		res = 0;
+	}
+
+	// Consume pending output first, then queue the unwritten new data
+	pending = c->outlen - c->outoff;
+	if (res < pending) {
+		c->outoff += res;
+		res = 0;
+	} else {
+		c->outoff = c->outlen = 0;
+		res -= pending;
+	}
+	for (i = 0; i < n; i++) {
+		if (res >= iov[i].iov_len) {
+			res -= iov[i].iov_len;
+			continue;
+		}
+		http_queue(c, iov[i].iov_base + res, iov[i].iov_len - res);
+		res = 0;
+	}
+
+	// Everything written?
+	if (c->outoff == c->outlen) {
+		c->outoff = c->outlen = 0;
+		if (c->close)
+			http_drop(c);
+	} else if (c->outlen - c->outoff > HTTP_MAX_PENDING) {
+		pr_err("HTTP client too slow, dropping\n");
+		http_drop(c);
+	}
+}
+
+static void http_respond(struct http_client *c, int status,
+			 const char *reason, const char *type,
+			 const char *body, size_t len)
+{
+	struct iovec iov[2];
+	char head[256];
+	int n;
+
+	n = snprintf(head, sizeof(head),
+		     "HTTP/1.1 %d %s\r\n"
+		     "Content-Type: %s\r\n"
+		     "Content-Length: %zu\r\n"
+		     "%s"
+		     "\r\n", status, reason, type, len,
+		     c->close ? "Connection: close\r\n" : "");
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = n;
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = len;
+	http_send(c, iov, 2);
+}
+
+static void http_error(struct http_client *c, int status, const char *reason)
+{
+	http_respond(c, status, reason, "text/plain", reason, strlen(reason));
+}
+
+/*
+ * Only accept the names of the loopback address, so a page loaded from
+ * another site cannot run commands through DNS rebinding
+ */
+static int http_host_ok(const char *host, size_t len)
+{
+	static const char * const names[] = { "localhost", "127.0.0.1" };
+	char port[16];
+	unsigned int i;
+	size_t n;
+
+	snprintf(port, sizeof(port), ":%d", http_port);
+	for (i = 0; i < sizeof(names) / sizeof(*names); i++) {
+		n = strlen(names[i]);
+		if (len < n || strncasecmp(host, names[i], n))
+			continue;
+		if (len == n)
+			return http_port == 80;
+		if (len - n == strlen(port) && !memcmp(host + n, port, len - n))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Same field value, case-insensitive */
+static int http_is(const char *s, size_t len, const char *value)
+{
+	return s && len == strlen(value) && !strncasecmp(s, value, len);
+}
+
+/*
+ * Browsers send "simple" requests to other origins without asking, e.g. for
+ * an image or a form.  Hence only accept commands in requests a page from
+ * another origin cannot make: a POST with our own Host and Origin, and a
+ * content type that needs a CORS preflight, which is never granted.
+ */
+static int http_exec_allowed(const struct http_fields *f)
+{
+	const char *origin = f->origin;
+	size_t len = f->originlen;
+
+	if (!f->host || !http_host_ok(f->host, f->hostlen))
+		return 0;
+	if (origin && (len < 7 || strncmp(origin, "http://", 7) ||
+		       !http_host_ok(origin + 7, len - 7)))
+		return 0;
+	if (f->site && !http_is(f->site, f->sitelen, "same-origin") &&
+	    !http_is(f->site, f->sitelen, "none"))
+		return 0;
+
+	return http_is(f->type, f->typelen, HTTP_EXEC_TYPE);
+}
+
+/* Run a command, or resynchronize if cmd is NULL, in the child process */
+static void __attribute__ ((noreturn)) http_child(int fd, const char *cmd,
+						  size_t len)
+{
+	uint64_t ts;
+	FILE *out;
+
+	out = fdopen(fd, "w");
+	if (!out)
+		_exit(1);
+
+	if (cmd) {
+		ts = mcu_cmd(http_ser, cmd, len, out);
+		fwrite(&ts, sizeof(ts), 1, out);
+	} else {
+		mcu_stop(http_ser);
+	}
+
+	// The parent still owns the port in the statistics
+	trace_flush();
+	_exit(fclose(out) ? 1 : 0);
+}
+
+/*
+ * Run a command in a child process sharing the port, so a timeout or link
+ * error fails the command instead of terminating the server.  All serial I/O
+ * happens in children, so no input read ahead is lost.  Returns the time the
+ * response started, followed by the response, or -1 on failure.
+ */
+static int http_fork(const char *cmd, size_t len, char **buf, size_t *size)
+{
+	int pfd[2], status;
+	char tmp[4096];
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe(pfd)) {
+		pr_err("Failed to create pipe: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	// Don't duplicate pending output in the child
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+	if (pid < 0) {
+		pr_err("Failed to fork: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	if (!pid) {
+		close(pfd[0]);
+		http_child(pfd[1], cmd, len);
+	}
+
+	close(pfd[1]);
+	*buf = NULL;
+	*size = 0;
+	while ((n = read(pfd[0], tmp, sizeof(tmp))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("Read error: %s\n", strerror(errno));
+			exit(-1);
+		}
+		*buf = http_alloc(*buf, *size + n);
+		memcpy(*buf + *size, tmp, n);
+		*size += n;
+	}
+	close(pfd[0]);
+
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		continue;
+
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+/*
+ * Execute a command, returning its response and the time it started, or -1.
+ * After a failure, the command is stopped, so the next one finds the prompt.
+ */
+static int http_cmd(const char *cmd, size_t len, uint64_t *ts, char **buf,
+		    size_t *size)
+{
+	char *junk;
+	size_t n;
+
+	if (!http_fork(cmd, len, buf, size) && *size >= sizeof(*ts)) {
+		*size -= sizeof(*ts);
+		memcpy(ts, *buf + *size, sizeof(*ts));
+		return 0;
+	}
+
+	free(*buf);
+	*buf = NULL;
+	pr_err("Command failed, resynchronizing\n");
+	if (http_fork(NULL, 0, &junk, &n))
+		pr_err("Failed to resynchronize\n");
+	free(junk);
+
+	return -1;
+}
+
+static void http_exec(struct http_client *c, const char *cmd, size_t len)
+{
+	char *line, *buf;
+	uint64_t ts;
+	size_t i, size;
+
+	// Only the first line is executed
+	for (i = 0; i < len; i++)
+		if (cmd[i] == '\r' || cmd[i] == '\n')
+			break;
+	len = i;
+	if (!len) {
+		http_error(c, 400, "Missing command");
+		return;
+	}
+
+	line = http_alloc(NULL, len + 2);
+	memcpy(line, cmd, len);
+	line[len++] = '\n';
+	line[len] = '\0';
+
+	if (!http_cmd(line, len, &ts, &buf, &size)) {
+		http_respond(c, 200, "OK", "text/plain; charset=utf-8", buf,
+			     size);
+		free(buf);
+	} else {
+		http_error(c, 502, "Bad Gateway");
+	}
+	free(line);
+}
+
+static void http_subscribe(struct http_client *c)
+{
+	static const char head[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"\r\n";
+	struct iovec iov[2] = {
+		{ .iov_base = (void *)head, .iov_len = sizeof(head) - 1 },
+		{ .iov_base = http_last, .iov_len = http_last_len },
+	};
+
+	c->events = 1;
+	http_send(c, iov, 2);
+}
+
+/* Returns a header field's value, without parameters, and its length */
+static const char *http_value(const char *s, size_t *len)
+{
+	s += strspn(s, " \t");
+	*len = strcspn(s, " \t\r;");
+	return s;
+}
+
+/* Handle one request, returns its total size, or 0 if incomplete */
+static size_t http_request(struct http_client *c)
+{
+	char *end, *p, *method, *target, *query, *hdr;
+	struct http_fields f = { NULL };
+	size_t head, body = 0;
+	int last = 0;
+
+	end = memmem(c->in, c->inlen, "\r\n\r\n", 4);
+	if (!end) {
+		if (c->inlen > HTTP_MAX_HEAD) {
+			c->close = 1;
+			http_error(c, 431, "Request Header Fields Too Large");
+		}
+		return 0;
+	}
+	*end = '\0';
+	head = end + 4 - c->in;
+
+	for (hdr = strstr(c->in, "\r\n"); hdr; hdr = strstr(hdr + 2, "\r\n")) {
+		if (!strncasecmp(hdr + 2, "Content-Length:", 15)) {
+			body = strtoul(hdr + 17, NULL, 10);
+		} else if (!strncasecmp(hdr + 2, "Connection:", 11) &&
+			   strcasestr(hdr + 13, "close")) {
+			last = 1;
+		} else if (!strncasecmp(hdr + 2, "Host:", 5)) {
+			f.host = http_value(hdr + 7, &f.hostlen);
+		} else if (!strncasecmp(hdr + 2, "Origin:", 7)) {
+			f.origin = http_value(hdr + 9, &f.originlen);
+		} else if (!strncasecmp(hdr + 2, "Sec-Fetch-Site:", 15)) {
+			f.site = http_value(hdr + 17, &f.sitelen);
+		} else if (!strncasecmp(hdr + 2, "Content-Type:", 13)) {
+			f.type = http_value(hdr + 15, &f.typelen);
+		}
+	}
+
+	if (body > HTTP_MAX_BODY) {
+		c->close = 1;
+		http_error(c, 413, "Content Too Large");
+		return c->inlen;
+	}
+	if (c->inlen < head + body) {
+		*end = '\r';
+		return 0;
+	}
+	c->close = last;
+
+	p = c->in;
+	method = strsep(&p, " ");
+	target = p ? strsep(&p, " ") : NULL;
+	if (!target || !p || strncmp(p, "HTTP/1.", 7)) {
+		c->close = 1;
+		http_error(c, 400, "Bad Request");
+		return head + body;
+	}
+	if (!strncmp(p, "HTTP/1.0", 8))
+		c->close = 1;
+
+	query = target;
+	strsep(&query, "?");
+	pr_debug("HTTP %s %s\n", method, target);
+
+	if (!strcmp(target, "/exec")) {
+		if (strcmp(method, "POST"))
+			http_error(c, 405, "Method Not Allowed");
+		else if (!http_exec_allowed(&f))
+			http_error(c, 403, "Forbidden");
+		else
+			http_exec(c, c->in + head, body);
+	} else if (!strcmp(target, "/events") && !strcmp(method, "GET")) {
+		http_subscribe(c);
+	} else {
+		http_error(c, 404, "Not Found");
+	}
+
+	return head + body;
+}
+
+static void http_read(struct http_client *c)
+{
+	size_t n;
+	ssize_t res;
+
+	if (c->insize - c->inlen < 4096) {
+		c->insize = c->insize * 2 + 4096;
+		c->in = http_alloc(c->in, c->insize + 1);
+	}
+
+	res = read(c->fd, c->in + c->inlen, c->insize - c->inlen);
+	if (res < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (res <= 0) {
+		http_drop(c);
+		return;
+	}
+	c->inlen += res;
+
+	// Pipelined requests are handled in order
+	while (c->fd >= 0 && !c->events && !c->close) {
+		c->in[c->inlen] = '\0';
+		n = http_request(c);
+		if (!n || c->fd < 0)
+			break;
+		c->inlen -= n;
+		memmove(c->in, c->in + n, c->inlen);
+	}
+
+	if (c->events)
+		c->inlen = 0;
+}
+
+static void http_broadcast(const char *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	unsigned int i;
+
+	for (i = 0; i < HTTP_MAX_CLIENTS; i++)
+		if (http_clients[i].fd >= 0 && http_clients[i].events)
+			http_send(&http_clients[i], &iov, 1);
+}
+
+/* Format a response as a Server-Sent Event, and send it to all subscribers */
+static void http_event(uint64_t ts, const char *buf, size_t len, void *arg)
+{
+	const char *end = buf + len, *nl;
+	size_t size;
+	FILE *f;
+
+	free(http_last);
+	f = open_memstream(&http_last, &size);
+	if (!f) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	fprintf(f, "id: %llu.%06llu\n", ts / NSEC_PER_SEC,
+		(ts % NSEC_PER_SEC) / NSEC_PER_USEC);
+	while (buf < end) {
+		nl = memchr(buf, '\n', end - buf);
+		if (!nl)
+			nl = end;
+		fputs("data: ", f);
+		fwrite(buf, 1, nl - buf, f);
+		fputc('\n', f);
+		buf = nl + 1;
+	}
+	fputc('\n', f);
+	fclose(f);
+	http_last_len = size;
+
+	http_broadcast(http_last, http_last_len);
+}
+
+/* Report a failed execution of the periodic command, to all subscribers */
+static void http_event_error(void)
+{
+	static const char ev[] = "event: error\ndata: Command failed\n\n";
+
+	http_broadcast(ev, sizeof(ev) - 1);
+}
+
+static int http_listen(int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		pr_err("Failed to create socket: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, HTTP_MAX_CLIENTS)) {
+		pr_err("Failed to listen on port %d: %s\n", port,
+		       strerror(errno));
+		exit(-1);
+	}
+
+	return fd;
+}
+
+static void http_accept(int lfd)
+{
+	unsigned int i;
+	int fd;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < HTTP_MAX_CLIENTS; i++) {
+		if (http_clients[i].fd < 0) {
+			http_clients[i].fd = fd;
+			pr_debug("HTTP client %d connected\n", fd);
+			return;
+		}
+	}
+
+	pr_err("Too many HTTP clients\n");
+	close(fd);
+}
+
+int http_run(const char *dev, int port, const char *cmd, size_t len)
+{
+	struct pollfd pfds[HTTP_MAX_CLIENTS + 1];
+	struct http_client *polled[HTTP_MAX_CLIENTS];
+	uint64_t next = 0, now, ts;
+	unsigned int i, n;
+	int lfd, timeout;
+	size_t size;
+	char *buf;
+
+	if (cmd && opt_interval <= 0) {
+		pr_err("Periodic command needs a positive interval\n");
+		exit(-1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < HTTP_MAX_CLIENTS; i++)
+		http_clients[i].fd = -1;
+
+	http_port = port;
+	lfd = http_listen(port);
+	http_ser = mcu_open(dev);
+	pr_info("Listening on http://127.0.0.1:%d/\n", port);
+	fflush(stdout);
+
+	while (1) {
+		timeout = -1;
+		if (cmd) {
+			now = get_time_ns();
+			if (now >= next) {
+				if (!http_cmd(cmd, len, &ts, &buf, &size)) {
+					http_event(ts, buf, size, NULL);
+					free(buf);
+				} else {
+					http_event_error();
+				}
+
+				next += opt_interval * NSEC_PER_MSEC;
+				if (next < now)
+					next = now + opt_interval *
+						     NSEC_PER_MSEC;
+				now = get_time_ns();
+			}
+			timeout = 0;
+			if (next > now)
+				timeout = (next - now + NSEC_PER_MSEC - 1) /
+					  NSEC_PER_MSEC;
+		}
+
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for (i = 0, n = 1; i < HTTP_MAX_CLIENTS; i++) {
+			struct http_client *c = &http_clients[i];
+
+			if (c->fd < 0)
+				continue;
+			polled[n - 1] = c;
+			pfds[n].fd = c->fd;
+			pfds[n].events = POLLIN;
+			if (c->outlen > c->outoff)
+				pfds[n].events |= POLLOUT;
+			n++;
+		}
+
+		if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+			pr_err("Poll error: %s\n", strerror(errno));
+			exit(-1);
+		}
+
+		if (pfds[0].revents & POLLIN)
+			http_accept(lfd);
+
+		for (i = 1; i < n; i++) {
+			struct http_client *c = polled[i - 1];
+
+			if (pfds[i].revents & POLLOUT)
+				http_send(c, NULL, 0);
+			if (c->fd >= 0 &&
+			    pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				http_read(c);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+/*
+ *  Loopback HTTP server for commands and live samples
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+
+extern int http_run(const char *dev, int port, const char *cmd, size_t len);
+
+#endif /* HTTP_H */
@@ -0,0 +1,643 @@
+/*
+ *  Parallel job execution
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  A job file describes named devices, and steps executing a command on a
+ *  device, possibly after other steps have completed successfully:
+ *
+ *      device <name> <path> [prompt=<regex>]
+ *      step <name> <device> [after=<step>[,<step>...]] [timeout=<ms>]
+ *           [delay=<ms>] [retry=<ms>] : <command>
+ *
+ *  Independent steps run concurrently, while steps on the same device are
+ *  executed in file order.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "mcuxeq.h"
+#include "jobs.h"
+
+#define JOB_MAX_DEVS		32
+#define JOB_MAX_STEPS		256
+#define JOB_MAX_DEPS		16
+
+#define JOB_RETRY_MS		200
+
+struct job_dev {
+	char *name;
+	char *path;
+	char *prompt;
+	uint64_t busy;
+};
+
+enum job_state {
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+	JOB_SKIPPED,
+};
+
+struct job_step {
+	char *name;
+	unsigned int dev;
+	char *cmd;
+	size_t len;
+	char *after;
+	int deps[JOB_MAX_DEPS];
+	unsigned int ndeps;
+	int prev;			/* Previous step on the same device */
+	int timeout, delay, retry;
+
+	enum job_state state;
+	pid_t pid;
+	int fd;
+	char *out;
+	size_t outlen;
+	uint64_t ready;			/* All dependencies completed */
+	uint64_t not_before;		/* Delay or retry pending */
+	uint64_t start;			/* Last attempt forked */
+	uint64_t end;
+	uint64_t busy;			/* Run time of all attempts */
+	unsigned int attempts;
+};
+
+static struct job_dev job_devs[JOB_MAX_DEVS];
+static unsigned int job_ndevs;
+static struct job_step job_steps[JOB_MAX_STEPS];
+static unsigned int job_nsteps;
+
+static const char *job_file;
+static unsigned int job_lineno;
+
+#define job_err(fmt, ...)						\
+	do {								\
+		pr_err("%s:%u: " fmt, job_file, job_lineno, ##__VA_ARGS__); \
+		exit(-1);						\
+	} while (0)
+
+static char *job_strdup(const char *s)
+{
+	char *p = strdup(s);
+
+	if (!p) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	return p;
+}
+
+/* Split off the next token, removing double quotes */
+static char *job_token(char **pp)
+{
+	char *p = *pp, *tok, *q;
+	int quoted = 0;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (!*p)
+		return NULL;
+
+	for (tok = q = p; *p; p++) {
+		if (*p == '"')
+			quoted = !quoted;
+		else if (!quoted && (*p == ' ' || *p == '\t'))
+			break;
+		else
+			*q++ = *p;
+	}
+	if (quoted)
+		job_err("Unterminated quote\n");
+
+	if (*p)
+		p++;
+	*q = '\0';
+	*pp = p;
+
+	return tok;
+}
+
+static int job_number(const char *s)
+{
+	char *end;
+	long val;
+
+	val = strtol(s, &end, 0);
+	if (*end || val < 0)
+		job_err("Invalid number %s\n", s);
+
+	return val;
+}
+
+static int job_find_dev(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < job_ndevs; i++)
+		if (!strcmp(job_devs[i].name, name))
+			return i;
+
+	return -1;
+}
+
+static int job_find_step(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < job_nsteps; i++)
+		if (!strcmp(job_steps[i].name, name))
+			return i;
+
+	return -1;
+}
+
+static void job_parse_dev(char *p)
+{
+	struct job_dev *dev = &job_devs[job_ndevs];
+	char *name, *path, *tok;
+
+	name = job_token(&p);
+	path = job_token(&p);
+	if (!path)
+		job_err("Missing device name or path\n");
+	if (job_find_dev(name) >= 0)
+		job_err("Duplicate device %s\n", name);
+	if (job_ndevs >= JOB_MAX_DEVS)
+		job_err("Too many devices\n");
+
+	dev->name = job_strdup(name);
+	dev->path = job_strdup(path);
+
+	while ((tok = job_token(&p))) {
+		if (!strncmp(tok, "prompt=", 7))
+			dev->prompt = job_strdup(tok + 7);
+		else
+			job_err("Unknown device attribute %s\n", tok);
+	}
+
+	job_ndevs++;
+}
+
+static void job_parse_step(char *p)
+{
+	struct job_step *step = &job_steps[job_nsteps];
+	char *name, *dev, *tok, *end;
+	int i;
+
+	name = job_token(&p);
+	dev = job_token(&p);
+	if (!dev)
+		job_err("Missing step name or device\n");
+	if (job_find_step(name) >= 0)
+		job_err("Duplicate step %s\n", name);
+	if (job_nsteps >= JOB_MAX_STEPS)
+		job_err("Too many steps\n");
+
+	i = job_find_dev(dev);
+	if (i < 0)
+		job_err("Unknown device %s\n", dev);
+
+	step->name = job_strdup(name);
+	step->dev = i;
+	step->prev = -1;
+
+	while (1) {
+		tok = job_token(&p);
+		if (!tok)
+			job_err("Missing command\n");
+		if (!strcmp(tok, ":"))
+			break;
+
+		if (!strncmp(tok, "after=", 6))
+			step->after = job_strdup(tok + 6);
+		else if (!strncmp(tok, "timeout=", 8))
+			step->timeout = job_number(tok + 8);
+		else if (!strncmp(tok, "delay=", 6))
+			step->delay = job_number(tok + 6);
+		else if (!strncmp(tok, "retry=", 6))
+			step->retry = job_number(tok + 6);
+		else
+			job_err("Unknown step attribute %s\n", tok);
+	}
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	for (end = p + strlen(p); end > p && (end[-1] == ' ' ||
+					       end[-1] == '\t'); end--)
+		;
+	if (end == p)
+		job_err("Missing command\n");
+
+	step->len = end - p + 1;
+	step->cmd = malloc(step->len + 1);
+	if (!step->cmd) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	memcpy(step->cmd, p, step->len - 1);
+	step->cmd[step->len - 1] = '\n';
+	step->cmd[step->len] = '\0';
+
+	for (i = job_nsteps - 1; i >= 0; i--) {
+		if (job_steps[i].dev == step->dev) {
+			step->prev = i;
+			break;
+		}
+	}
+
+	job_nsteps++;
+}
+
+static void job_parse(const char *pathname)
+{
+	char *line = NULL, *p, *tok;
+	size_t size = 0;
+	FILE *f;
+
+	f = fopen(pathname, "r");
+	if (!f) {
+		pr_err("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	job_file = pathname;
+	while (getline(&line, &size, f) > 0) {
+		job_lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		p = line;
+		tok = job_token(&p);
+		if (!tok || tok[0] == '#')
+			continue;
+
+		if (!strcmp(tok, "device"))
+			job_parse_dev(p);
+		else if (!strcmp(tok, "step"))
+			job_parse_step(p);
+		else
+			job_err("Unknown keyword %s\n", tok);
+	}
+
+	free(line);
+	fclose(f);
+}
+
+/* Resolve dependencies by name, and reject cycles */
+static void job_resolve(void)
+{
+	unsigned int i, j, n, changed;
+	struct job_step *step;
+	char *p, *dep;
+	int k;
+
+	for (i = 0; i < job_nsteps; i++) {
+		step = &job_steps[i];
+		for (p = step->after; p && (dep = strsep(&p, ","));) {
+			if (!*dep)
+				continue;
+			k = job_find_step(dep);
+			if (k < 0) {
+				pr_err("%s: Step %s depends on unknown step %s\n",
+				       job_file, step->name, dep);
+				exit(-1);
+			}
+			if (step->ndeps >= JOB_MAX_DEPS) {
+				pr_err("%s: Step %s has too many dependencies\n",
+				       job_file, step->name);
+				exit(-1);
+			}
+			step->deps[step->ndeps++] = k;
+		}
+	}
+
+	// Peel off steps whose predecessors have all been peeled off
+	for (changed = 1; changed;) {
+		changed = 0;
+		for (i = 0; i < job_nsteps; i++) {
+			step = &job_steps[i];
+			if (step->state == JOB_DONE)
+				continue;
+
+			n = step->prev >= 0 &&
+			    job_steps[step->prev].state != JOB_DONE;
+			for (j = 0; j < step->ndeps; j++)
+				n += job_steps[step->deps[j]].state != JOB_DONE;
+			if (n)
+				continue;
+
+			step->state = JOB_DONE;
+			changed = 1;
+		}
+	}
+
+	for (i = 0; i < job_nsteps; i++) {
+		if (job_steps[i].state != JOB_DONE) {
+			pr_err("%s: Dependency cycle involving step %s\n",
+			       job_file, job_steps[i].name);
+			exit(-1);
+		}
+		job_steps[i].state = JOB_PENDING;
+	}
+}
+
+static void job_launch(struct job_step *step)
+{
+	struct job_dev *dev = &job_devs[step->dev];
+	int pfd[2];
+
+	if (pipe(pfd)) {
+		pr_err("Failed to create pipe: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	// Don't duplicate pending output in the child
+	fflush(stdout);
+	fflush(stderr);
+
+	step->pid = fork();
+	if (step->pid < 0) {
+		pr_err("Failed to fork: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	if (!step->pid) {
+		close(pfd[0]);
+		if (dup2(pfd[1], STDOUT_FILENO) < 0) {
+			pr_err("Failed to redirect output: %s\n",
+			       strerror(errno));
+			exit(-1);
+		}
+		close(pfd[1]);
+
+		if (step->timeout)
+			opt_timeout = step->timeout;
+		prompt_init(dev->prompt ? dev->prompt : opt_prompt);
+		mcu_exec(dev->path, step->cmd, step->len);
+		exit(0);
+	}
+
+	pr_debug("Started step %s (pid %d)\n", step->name, step->pid);
+	step->start = get_time_ns();
+	close(pfd[1]);
+	step->fd = pfd[0];
+	step->outlen = 0;
+	step->attempts++;
+	step->state = JOB_RUNNING;
+}
+
+static void job_output(const struct job_step *step)
+{
+	const char *p = step->out, *end = step->out + step->outlen, *nl;
+
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		nl = nl ? nl + 1 : end;
+		printf("[%s] ", step->name);
+		fwrite(p, 1, nl - p, stdout);
+		if (nl[-1] != '\n')
+			printf("\n");
+		p = nl;
+	}
+}
+
+static void job_read(struct job_step *step, uint64_t now)
+{
+	char buf[4096];
+	ssize_t n;
+	int status;
+
+	n = read(step->fd, buf, sizeof(buf));
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		pr_err("Read error: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	if (n) {
+		step->out = realloc(step->out, step->outlen + n);
+		if (!step->out) {
+			pr_err("Failed to allocate buffer: %s\n",
+			       strerror(errno));
+			exit(-1);
+		}
+		memcpy(step->out + step->outlen, buf, n);
+		step->outlen += n;
+		return;
+	}
+
+	// End of output, collect exit status
+	close(step->fd);
+	if (waitpid(step->pid, &status, 0) < 0) {
+		pr_err("Failed to wait for step %s: %s\n", step->name,
+		       strerror(errno));
+		exit(-1);
+	}
+
+	// The device is busy during failed attempts too, but not in between
+	step->busy += now - step->start;
+	job_devs[step->dev].busy += now - step->start;
+
+	if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+		step->state = JOB_DONE;
+	} else if (now - step->ready < step->retry * NSEC_PER_MSEC) {
+		pr_debug("Step %s failed, retrying\n", step->name);
+		step->state = JOB_PENDING;
+		step->not_before = now + JOB_RETRY_MS * NSEC_PER_MSEC;
+		return;
+	} else {
+		pr_err("Step %s failed\n", step->name);
+		step->state = JOB_FAILED;
+	}
+
+	step->end = now;
+	job_output(step);
+}
+
+/* Returns the poll timeout until the next delayed step, or -1 */
+static int job_schedule(uint64_t now)
+{
+	unsigned int i, j, changed;
+	struct job_step *step, *dep;
+	int timeout = -1, ms, wait;
+
+	do {
+		changed = 0;
+		for (i = 0; i < job_nsteps; i++) {
+			step = &job_steps[i];
+			if (step->state != JOB_PENDING || step->ready)
+				continue;
+
+			if (step->prev >= 0 &&
+			    job_steps[step->prev].state <= JOB_RUNNING)
+				continue;
+
+			for (wait = 0, j = 0; j < step->ndeps; j++) {
+				dep = &job_steps[step->deps[j]];
+				if (dep->state >= JOB_FAILED) {
+					pr_err("Skipping step %s\n",
+					       step->name);
+					step->state = JOB_SKIPPED;
+					step->ready = step->start = now;
+					step->end = now;
+					changed = 1;
+					break;
+				}
+				if (dep->state != JOB_DONE)
+					wait = 1;
+			}
+			if (step->state != JOB_PENDING || wait)
+				continue;
+
+			step->ready = now;
+			step->not_before = now + step->delay * NSEC_PER_MSEC;
+		}
+	} while (changed);
+
+	for (i = 0; i < job_nsteps; i++) {
+		step = &job_steps[i];
+		if (step->state != JOB_PENDING || !step->ready)
+			continue;
+
+		if (now >= step->not_before) {
+			job_launch(step);
+			continue;
+		}
+
+		ms = (step->not_before - now + NSEC_PER_MSEC - 1) /
+		     NSEC_PER_MSEC;
+		if (timeout < 0 || ms < timeout)
+			timeout = ms;
+	}
+
+	return timeout;
+}
+
+/* The step whose completion released the given step */
+static int job_gate(const struct job_step *step)
+{
+	int i, gate = step->prev;
+
+	for (i = 0; i < step->ndeps; i++)
+		if (gate < 0 ||
+		    job_steps[step->deps[i]].end > job_steps[gate].end)
+			gate = step->deps[i];
+
+	return gate;
+}
+
+static void job_report(uint64_t t0, uint64_t t1)
+{
+	static const char * const states[] = {
+		[JOB_PENDING] = "pending",
+		[JOB_RUNNING] = "running",
+		[JOB_DONE] = "ok",
+		[JOB_FAILED] = "failed",
+		[JOB_SKIPPED] = "skipped",
+	};
+	char start[16], end[16], dur[16];
+	uint64_t span = t1 - t0, total = 0;
+	int path[JOB_MAX_STEPS], n = 0, last = -1, i;
+	const struct job_step *step;
+
+	pr_err("\n%-16s %-12s %10s %10s %10s %4s  %s\n", "STEP", "DEVICE",
+	       "START", "END", "DURATION", "RUNS", "STATUS");
+	for (i = 0; i < job_nsteps; i++) {
+		step = &job_steps[i];
+		total += step->busy;
+		if (step->state <= JOB_FAILED &&
+		    (last < 0 || step->end > job_steps[last].end))
+			last = i;
+
+		pr_err("%-16s %-12s %10s %10s %10s %4u  %s\n", step->name,
+		       job_devs[step->dev].name,
+		       format_ns(start, sizeof(start), step->start - t0),
+		       format_ns(end, sizeof(end), step->end - t0),
+		       format_ns(dur, sizeof(dur), step->end - step->start),
+		       step->attempts, states[step->state]);
+	}
+
+	pr_err("\nMakespan %s, total step time %s, parallelism %.2f\n",
+	       format_ns(dur, sizeof(dur), span), format_ns(end, sizeof(end),
+	       total), span ? (double)total / span : 0.0);
+
+	for (i = last; i >= 0 && n < JOB_MAX_STEPS; i = job_gate(step)) {
+		step = &job_steps[i];
+		path[n++] = i;
+	}
+	if (n) {
+		pr_err("Critical path:");
+		while (n--)
+			pr_err(" %s%s", job_steps[path[n]].name,
+			       n ? " ->" : "");
+		pr_err("\n");
+	}
+
+	pr_err("Device utilization:");
+	for (i = 0; i < job_ndevs; i++)
+		pr_err(" %s %.1f%%", job_devs[i].name,
+		       span ? 100.0 * job_devs[i].busy / span : 0.0);
+	pr_err("\n");
+}
+
+int jobs_run(const char *pathname)
+{
+	struct pollfd pfds[JOB_MAX_STEPS];
+	struct job_step *running[JOB_MAX_STEPS];
+	unsigned int i, n, failed = 0;
+	uint64_t t0, now;
+	int timeout, res;
+
+	job_parse(pathname);
+	job_resolve();
+
+	t0 = now = get_time_ns();
+	while (1) {
+		timeout = job_schedule(now);
+
+		for (i = 0, n = 0; i < job_nsteps; i++) {
+			if (job_steps[i].state != JOB_RUNNING)
+				continue;
+			running[n] = &job_steps[i];
+			pfds[n].fd = job_steps[i].fd;
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			n++;
+		}
+
+		if (!n && timeout < 0)
+			break;
+
+		res = poll(pfds, n, timeout);
+		if (res < 0 && errno != EINTR) {
+			pr_err("Poll error: %s\n", strerror(errno));
+			exit(-1);
+		}
+
+		now = get_time_ns();
+		for (i = 0; res > 0 && i < n; i++)
+			if (pfds[i].revents)
+				job_read(running[i], now);
+	}
+
+	fflush(stdout);
+	job_report(t0, now);
+
+	for (i = 0; i < job_nsteps; i++)
+		if (job_steps[i].state != JOB_DONE)
+			failed++;
+
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,15 @@
+/*
+ *  Parallel job execution
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+extern int jobs_run(const char *pathname);
+
+#endif /* JOBS_H */
@@ -0,0 +1,171 @@
+/*
+ *  Keepalive for idle serial ports
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  When a port has been idle for the keepalive interval, a child process
+ *  sends a cheap command, and waits for its prompt.  This keeps the stream
+ *  synchronized, and detects dead boards and disappeared adapters early.
+ *  The verdict is published in the port's statistics segment, so regular
+ *  invocations fail immediately for a dead device, instead of running into
+ *  a timeout.  Ports in use by other processes are never waited for.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "mcuxeq.h"
+#include "keepalive.h"
+#include "stats.h"
+
+#define KEEPALIVE_DEAD_MS	1000	/* Retry interval for dead devices */
+#define KEEPALIVE_TICK_MS	50
+
+#define KEEPALIVE_BUSY		3	/* Probe exit code for a busy port */
+
+struct ka_dev {
+	const char *path;
+	struct stats *stats;
+	pid_t pid;
+	uint64_t last_probe;
+	enum stats_health health;
+};
+
+static void __attribute__ ((noreturn)) ka_probe(const char *path,
+						const char *cmd, size_t len)
+{
+	FILE *null;
+	int fd;
+
+	// Probes would skew the port's command rate, latency, and utilization
+	stats_disable();
+	fd = mcu_try_open(path);
+	if (fd < 0)
+		exit(KEEPALIVE_BUSY);
+
+	null = fopen("/dev/null", "w");
+	if (!null) {
+		pr_err("Failed to open /dev/null: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	mcu_cmd(fd, cmd, len, null);
+	mcu_close(fd);
+	exit(0);
+}
+
+static uint64_t ka_due(const struct ka_dev *dev, uint64_t interval)
+{
+	struct stats_snapshot snap;
+	uint64_t idle = dev->last_probe;
+
+	if (dev->health == STATS_UNKNOWN)
+		return 0;
+
+	if (dev->health == STATS_DEAD &&
+	    interval > KEEPALIVE_DEAD_MS * NSEC_PER_MSEC)
+		interval = KEEPALIVE_DEAD_MS * NSEC_PER_MSEC;
+
+	if (dev->stats) {
+		stats_read(dev->stats, &snap);
+		if (snap.owner)
+			return UINT64_MAX;
+		if (dev->stats->last_used > idle)
+			idle = dev->stats->last_used;
+	}
+
+	return idle + interval;
+}
+
+static void ka_verdict(struct ka_dev *dev, int status)
+{
+	enum stats_health health;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == KEEPALIVE_BUSY) {
+		pr_debug("%s: busy, skipping keepalive\n", dev->path);
+		return;
+	}
+
+	health = WIFEXITED(status) && !WEXITSTATUS(status) ? STATS_HEALTHY
+							    : STATS_DEAD;
+	if (health != dev->health) {
+		pr_info("%s: %s\n", dev->path, health == STATS_HEALTHY ?
+			"responding" : "not responding");
+		fflush(stdout);
+	}
+
+	dev->health = health;
+	if (dev->stats)
+		stats_set_health(dev->stats, health);
+}
+
+int keepalive_run(const char * const devs[], unsigned int ndevs,
+		  const char *cmd, size_t len, int interval)
+{
+	struct ka_dev *ka, *dev;
+	unsigned int i;
+	uint64_t now;
+	int status;
+	pid_t pid;
+
+	if (interval <= 0) {
+		pr_err("Invalid keepalive interval %d\n", interval);
+		exit(-1);
+	}
+
+	ka = calloc(ndevs, sizeof(*ka));
+	if (!ka) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	for (i = 0; i < ndevs; i++) {
+		ka[i].path = devs[i];
+		ka[i].stats = stats_map(devs[i]);
+		if (!ka[i].stats)
+			pr_err("%s: No statistics, health will not be shared\n",
+			       devs[i]);
+	}
+
+	while (1) {
+		now = get_time_ns();
+		for (i = 0; i < ndevs; i++) {
+			dev = &ka[i];
+			if (dev->pid || now < ka_due(dev,
+						     interval * NSEC_PER_MSEC))
+				continue;
+
+			fflush(stdout);
+			dev->pid = fork();
+			if (dev->pid < 0) {
+				pr_err("Failed to fork: %s\n", strerror(errno));
+				exit(-1);
+			}
+			if (!dev->pid)
+				ka_probe(dev->path, cmd, len);
+
+			dev->last_probe = now;
+		}
+
+		usleep(KEEPALIVE_TICK_MS * 1000);
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < ndevs; i++) {
+				if (ka[i].pid != pid)
+					continue;
+				ka[i].pid = 0;
+				ka[i].last_probe = get_time_ns();
+				ka_verdict(&ka[i], status);
+			}
+		}
+	}
+
+	return 0;
+}
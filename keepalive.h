@@ -0,0 +1,18 @@
+/*
+ *  Keepalive for idle serial ports
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef KEEPALIVE_H
+#define KEEPALIVE_H
+
+#include <stddef.h>
+
+extern int keepalive_run(const char * const devs[], unsigned int ndevs,
+			 const char *cmd, size_t len, int interval);
+
+#endif /* KEEPALIVE_H */
@@ -7,15 +7,20 @@
  *  License.
  */
 
+#define _GNU_SOURCE
+
 #include <cap-ng.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <bsd/stdlib.h>
@@ -27,28 +32,122 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "mcuxeq.h"
+#include "hist.h"
+#include "jobs.h"
+#include "adapt.h"
+#include "calib.h"
+#include "config.h"
+#include "digest.h"
+#include "dump.h"
+#include "http.h"
+#include "keepalive.h"
+#include "mock.h"
+#include "merge.h"
+#include "profile.h"
+#include "serve.h"
+#include "stats.h"
+#include "trace.h"
+#include "unpack.h"
+
 #define MCUXEQ_DEV_ENV		"MCUXEQ_DEV"
 #define MCUXEQ_PROMPT_ENV	"MCUXEQ_PROMPT"
 
 #define DEFAULT_PROMPT		"^[[:alnum:]]*[#$>] $"
 #define DEFAULT_TIMEOUT_MS	2000
+#define DEFAULT_TOP_INTERVAL_MS	250
+#define DEFAULT_WATERMARK_MS	1000
+
+#define DEFAULT_STOP		"^C"
+#define DEFAULT_HEADROOM	20	/* % */
 
 #define BUF_SIZE		64
-#define LINE_SIZE		1024
 
-#define RETRY_MS		200
+#define MAX_DEVS		32
 
-static const char *opt_dev;
-static const char *opt_prompt;
-static int opt_timeout = DEFAULT_TIMEOUT_MS;
-static int opt_debug;
+#define RETRY_MS		200
+#define TX_DRAIN_POLL_MS	1
+
+const char *opt_dev;
+static const char *opt_devs[2 * MAX_DEVS];
+static unsigned int opt_ndevs;
+static const char *opt_locks[MAX_DEVS];
+static unsigned int opt_nlocks;
+const char *opt_prompt;
+int opt_timeout = DEFAULT_TIMEOUT_MS;
+int opt_interval;
+unsigned int opt_count = 1;
+static int opt_count_set;
+int opt_debug;
 static int opt_force;
+static int opt_aliases;
+static int opt_top;
+static int opt_timestamps;
+static int opt_merge;
+static int opt_watermark = DEFAULT_WATERMARK_MS;
+static int opt_keepalive;
+static int opt_http;
+static const char *opt_dump;
+static const char *opt_config;
+static const char *opt_check;
+static int opt_window = DEFAULT_WINDOW;
+static const char *opt_reject = DEFAULT_REJECT;
+static const char *opt_record;
+static const char *opt_trace;
+static const char *opt_adaptive;
+static int opt_min_interval;
+static int opt_max_interval;
+static struct dump_opts opt_dump_opts = {
+	.block = DEFAULT_DUMP_BLOCK,
+	.crc_cmd = DEFAULT_CRC_CMD,
+	.read_cmd = DEFAULT_READ_CMD,
+};
+static int opt_timing;
+static int opt_rx_stats;
+static const char *opt_jobs;
+static int opt_stream;
+static int opt_duration;
+static unsigned long long opt_bytes;
+static const char *opt_stop = DEFAULT_STOP;
+static const char *opt_digest;
+static const char *opt_expect_digest;
+static unsigned long long opt_expect_size;
+static int opt_serve = -1;
 
 static regex_t regex_prompt;
-
-#define pr_debug(fmt, ...)	{ if (opt_debug) printf(fmt, ##__VA_ARGS__); }
-#define pr_info(fmt, ...)	printf(fmt, ##__VA_ARGS__)
-#define pr_err(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+static char prompt_seen[LINE_SIZE];	/* Matched prompt, for --record */
+static size_t prompt_seen_len;
+
+static int tx_draining;
+static const char *mcu_dev;
+
+static FILE *digest_out;
+static int opt_unpack;
+static int opt_calibrate;
+static unsigned int opt_headroom = DEFAULT_HEADROOM;
+static FILE *unpack_out;
+static FILE *data_out;		/* Response data sink, if not stdout */
+
+static unsigned char rx_buf[BUF_SIZE];
+static size_t rx_pos, rx_len;
+
+static unsigned int ser_baud;
+static unsigned int ser_char_bits;
+
+static struct {
+	uint64_t last;		/* Time of the previous read() */
+	uint64_t bytes;
+	struct hist size;	/* Bytes returned per read() */
+	struct hist gap;	/* Time between consecutive read()s */
+} rx_stats;
+
+static struct {
+	uint64_t start;		/* Command about to be written */
+	uint64_t write;		/* Command accepted by the kernel */
+	uint64_t drain;		/* Last byte of the command on the wire */
+	uint64_t echo;		/* Command echo received */
+	uint64_t prompt;	/* Prompt received */
+} timing;
 
 static inline unsigned char mkprint(unsigned char c)
 {
@@ -79,21 +178,103 @@ static void __attribute__ ((noreturn)) usage(void)
 {
 	fprintf(stderr,
 		"\n"
-		"%s: [options] [--] <command> ...\n\n"
+		"%s: [options] [--] <command> ...\n"
+		"%s: [options] --top\n"
+		"%s: [options] --jobs <file>\n"
+		"%s: [options] --keepalive <ms> [--] [<command> ...]\n"
+		"%s: [options] --http <port> [--] [<command> ...]\n"
+		"%s: [options] --dump <file> [--size <n>]\n"
+		"%s: [options] --config <file> [--check <command>]\n\n"
 		"Valid options are:\n"
 		"    -h, --help              Display this usage information\n"
-		"    -s, --device <dev>      Serial device to use\n"
+		"    -s, --device <dev>      Serial device to use, can be repeated\n"
 		"                            (Default: value of $%s if set)\n"
+		"    -L, --lock <dev>        Keep another device locked while\n"
+		"                            executing, can be repeated\n"
 		"    -p, --prompt <prompt>   Expected prompt regex\n"
 		"                            (Default: value of $%s if set)\n"
 		"                            (Default: \"%s\")\n"
 		"    -t, --timeout <ms>      Timeout value in milliseconds\n"
 		"                            (Default: %u)\n"
 		"    -d, --debug             Increase debug level\n"
-		"    -f, --force             Force open when busy (needs CAP_SYS_ADMIN)"
+		"    -f, --force             Force open when busy (needs CAP_SYS_ADMIN)\n"
+		"    -n, --count <n>         Number of times to execute the command\n"
+		"                            (Default: 1, 0 is forever)\n"
+		"    -i, --interval <ms>     Repeat or refresh interval in milliseconds\n"
+		"                            (Default: 0, %u for --top)\n"
+		"    -A, --aliases           Define an alias from the device's profile\n"
+		"                            for a repeated command, and send that\n"
+		"    -S, --timestamps        Prefix output lines with receive timestamps\n"
+		"    -a, --adaptive <delta>  Adapt the interval to changes of numbers\n"
+		"                            in the response by more than <delta>\n"
+		"                            (absolute, or relative if ending in %%)\n"
+		"    --min-interval <ms>     Minimum interval for --adaptive\n"
+		"                            (Default: --interval / 8)\n"
+		"    --max-interval <ms>     Maximum interval for --adaptive\n"
+		"                            (Default: --interval * 8)\n"
+		"    --calibrate             Find the maximum sustainable rate of a\n"
+		"                            command, starting at --interval, with\n"
+		"                            --count commands per step, and store it\n"
+		"                            in the device's profile\n"
+		"    --headroom <percent>    Headroom for --calibrate (Default: %u)\n"
+		"    -m, --merge             Merge output of multiple devices in\n"
+		"                            timestamp order\n"
+		"    -w, --watermark <ms>    Maximum lateness for --merge\n"
+		"                            (Default: %u)\n"
+		"    --stream                Forward the output of a command that does\n"
+		"                            not return to the prompt\n"
+		"    --duration <ms>         Stop streaming after <ms>\n"
+		"    --bytes <n>             Stop streaming after <n> bytes\n"
+		"    --stop <seq>            Sequence stopping a command, \"^X\" is a\n"
+		"                            control character (Default: \"%s\")\n"
+		"    -Z, --unpack            Decode base64-wrapped LZ4 or heatshrink\n"
+		"                            compressed blocks in responses\n"
+		"    --digest <algo>         Print a digest of the response instead\n"
+		"                            (crc32c, xxhash, or sha256)\n"
+		"    --expect-digest <hex>   Compare the response's digest, and print\n"
+		"                            OK or Mismatch\n"
+		"    --expect-size <n>       Expected size of the response, stop the\n"
+		"                            command as soon as it is exceeded\n"
+		"    --top                   Monitor queues and latencies of all\n"
+		"                            (or the selected) serial devices\n"
+		"    -j, --jobs <file>       Run the steps of a job file in parallel\n"
+		"    -k, --keepalive <ms>    Send a keepalive command (Default: empty\n"
+		"                            line) to devices idle for <ms>\n"
+		"    --http <port>           Serve commands and periodic samples of\n"
+		"                            <command> over HTTP on 127.0.0.1:<port>\n"
+		"    --serve <fd>            Execute commands received on socket <fd>,\n"
+		"                            for the Python module\n"
+		"    --dump <file>           Dump memory to <file>, reading only blocks\n"
+		"                            that differ from its current contents\n"
+		"    --base <addr>           Start address for --dump (Default: 0)\n"
+		"    --size <n>              Size for --dump (Default: file size)\n"
+		"    --block <n>             Block size for --dump (Default: %u)\n"
+		"    --crc-cmd <fmt>         Command to get the CRC-32 of a block\n"
+		"                            (Default: \"%s\")\n"
+		"    --read-cmd <fmt>        Command to dump a block\n"
+		"                            (Default: \"%s\")\n"
+		"    --config <file>         Send the lines of <file> that changed\n"
+		"                            since the last upload to the device\n"
+		"    --check <command>       Command validating the cached upload\n"
+		"    --window <n>            Maximum commands in flight for --config\n"
+		"                            (Default: %u)\n"
+		"    --reject <regex>        Response marking a --config line rejected\n"
+		"                            (Default: \"%s\")\n"
+		"    --record <file>         Record commands and responses, for use\n"
+		"                            with mock devices\n"
+		"    --trace <file>          Append spans of the commands' lock wait,\n"
+		"                            open, write, echo wait, and response to\n"
+		"                            <file>, in Chrome trace-event format\n"
+		"    -T, --timing            Print transmit, echo, and prompt times\n"
+		"    -R, --rx-stats          Print read size and inter-read gap\n"
+		"                            histograms\n"
 		"\n",
-		getprogname(), MCUXEQ_DEV_ENV, MCUXEQ_PROMPT_ENV,
-		DEFAULT_PROMPT, DEFAULT_TIMEOUT_MS);
+		getprogname(), getprogname(), getprogname(), getprogname(),
+		getprogname(), getprogname(), getprogname(), MCUXEQ_DEV_ENV,
+		MCUXEQ_PROMPT_ENV, DEFAULT_PROMPT, DEFAULT_TIMEOUT_MS,
+		DEFAULT_TOP_INTERVAL_MS, DEFAULT_HEADROOM, DEFAULT_WATERMARK_MS,
+		DEFAULT_STOP, DEFAULT_DUMP_BLOCK, DEFAULT_CRC_CMD,
+		DEFAULT_READ_CMD, DEFAULT_WINDOW, DEFAULT_REJECT);
 	exit(1);
 }
 
@@ -108,6 +289,44 @@ static void get_time(struct timeval *tv)
 	}
 }
 
+uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		pr_err("Failed to get time: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+uint64_t get_realtime_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts)) {
+		pr_err("Failed to get time: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+const char *format_ns(char *buf, size_t size, uint64_t ns)
+{
+	if (ns < NSEC_PER_USEC)
+		snprintf(buf, size, "%uns", (unsigned int)ns);
+	else if (ns < NSEC_PER_MSEC)
+		snprintf(buf, size, "%.1fus", (double)ns / NSEC_PER_USEC);
+	else if (ns < NSEC_PER_SEC)
+		snprintf(buf, size, "%.1fms", (double)ns / NSEC_PER_MSEC);
+	else
+		snprintf(buf, size, "%.2fs", (double)ns / NSEC_PER_SEC);
+
+	return buf;
+}
+
 static void timeout_init(struct timeval *tv)
 {
 	if (opt_timeout <= 0)
@@ -138,27 +357,79 @@ static int timed_out(struct timeval *tv)
 	       (now.tv_sec == tv->tv_sec && now.tv_usec > tv->tv_usec);
 }
 
-static int ser_open(const char *pathname, int flags)
+static unsigned int baud_rate(speed_t speed)
 {
-	struct termios termios;
-	struct timeval tv;
-	int fd;
+	static const struct {
+		speed_t speed;
+		unsigned int baud;
+	} rates[] = {
+		{ B50, 50 }, { B75, 75 }, { B110, 110 }, { B134, 134 },
+		{ B150, 150 }, { B200, 200 }, { B300, 300 }, { B600, 600 },
+		{ B1200, 1200 }, { B1800, 1800 }, { B2400, 2400 },
+		{ B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 },
+		{ B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 },
+		{ B230400, 230400 }, { B460800, 460800 }, { B500000, 500000 },
+		{ B576000, 576000 }, { B921600, 921600 },
+		{ B1000000, 1000000 }, { B1152000, 1152000 },
+		{ B1500000, 1500000 }, { B2000000, 2000000 },
+		{ B2500000, 2500000 }, { B3000000, 3000000 },
+		{ B3500000, 3500000 }, { B4000000, 4000000 },
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(rates) / sizeof(*rates); i++)
+		if (rates[i].speed == speed)
+			return rates[i].baud;
+
+	return 0;
+}
+
+/* Start bit, data bits, parity bit, and stop bits */
+static unsigned int char_bits(const struct termios *termios)
+{
+	static const unsigned int data_bits[] = {
+		[CS5] = 5, [CS6] = 6, [CS7] = 7, [CS8] = 8,
+	};
 
+	return 1 + data_bits[termios->c_cflag & CSIZE] +
+	       !!(termios->c_cflag & PARENB) +
+	       (termios->c_cflag & CSTOPB ? 2 : 1);
+}
+
+static void ser_drop_caps(void)
+{
 	if (!opt_force) {
 		// Drop CAP_SYS_ADMIN to honor current TIOCEXCL state
 		capng_fill(CAPNG_SELECT_BOTH);
 		capng_update(CAPNG_DROP, CAPNG_EFFECTIVE, CAP_SYS_ADMIN);
 		capng_apply(CAPNG_SELECT_BOTH);
 	}
+}
+
+/*
+ * Open and lock a port, retrying until the deadline in tv.
+ * Returns -1 if the port is busy and nowait is set.
+ */
+static int ser_lock(const char *pathname, int flags, int nowait,
+		    struct timeval *tv)
+{
+	int fd, err;
 
 	pr_debug("Opening %s...\n", pathname);
-	timeout_init(&tv);
 	while (1) {
 		fd = open(pathname, flags);
 		if (fd >= 0 && (opt_force || !flock(fd,  LOCK_EX | LOCK_NB)))
 			break;
 
-		if ((errno != EBUSY && errno != EAGAIN) || timed_out(&tv)) {
+		err = errno;
+		if (fd >= 0)
+			close(fd);
+		errno = err;
+
+		if (nowait && (errno == EBUSY || errno == EAGAIN))
+			return -1;
+
+		if ((errno != EBUSY && errno != EAGAIN) || timed_out(tv)) {
 			pr_err("Failed to open %s: %s\n", pathname,
 			       strerror(errno));
 			exit(-1);
@@ -174,13 +445,23 @@ static int ser_open(const char *pathname, int flags)
 		exit(-1);
 	}
 
+	return fd;
+}
+
+static void ser_setup(int fd)
+{
+	struct termios termios;
+
 	if (tcgetattr(fd, &termios)) {
 		pr_err("Failed to get terminal attributes: %s\n",
 		       strerror(errno));
 		exit(-1);
 	}
 
+	ser_baud = baud_rate(cfgetispeed(&termios));
+
 	cfmakeraw(&termios);
+	ser_char_bits = char_bits(&termios);
 	if (tcsetattr(fd, TCSANOW, &termios)) {
 		pr_err("Failed to enable raw mode: %s\n", strerror(errno));
 		exit(-1);
@@ -190,25 +471,128 @@ static int ser_open(const char *pathname, int flags)
 		pr_err("Failed to flush: %s\n", strerror(errno));
 		exit(-1);
 	}
+}
+
+/* Returns -1 if the port is busy and nowait is set */
+static int ser_open(const char *pathname, int flags, int nowait)
+{
+	struct timeval tv;
+	uint64_t t0, t1;
+	int fd;
+
+	ser_drop_caps();
+
+	stats_wait_begin();
+	t0 = get_time_ns();
+	timeout_init(&tv);
+	fd = ser_lock(pathname, flags, nowait, &tv);
+	t1 = get_time_ns();
+	stats_wait_end();
+	trace_span("lock wait", t0, t1, NULL, 0);
+	if (fd < 0)
+		return -1;
+
+	ser_setup(fd);
+	trace_span("open", t1, get_time_ns(), NULL, 0);
 
 	return fd;
 }
 
+/* Note when the transmit queue has drained, i.e. the last byte has left */
+static void tx_drain_check(int fd)
+{
+	int outq;
+
+	if (ioctl(fd, TIOCOUTQ, &outq)) {
+		pr_debug("Failed to get output queue size: %s\n",
+			 strerror(errno));
+		tx_draining = 0;
+		return;
+	}
+
+	if (!outq) {
+		timing.drain = get_time_ns();
+		tx_draining = 0;
+	}
+}
+
+/*
+ * Wait for receive data like poll(), but while the transmit queue is being
+ * drained, wake up regularly to check its progress.
+ */
+static int ser_poll(struct pollfd *pfd)
+{
+	int timeout = opt_timeout, res;
+	uint64_t end, now;
+
+	end = get_time_ns() + opt_timeout * NSEC_PER_MSEC;
+	while (tx_draining && timeout) {
+		res = poll(pfd, 1, timeout < 0 || timeout > TX_DRAIN_POLL_MS ?
+				   TX_DRAIN_POLL_MS : timeout);
+		tx_drain_check(pfd->fd);
+		if (res)
+			return res;
+
+		if (timeout > 0) {
+			now = get_time_ns();
+			if (now >= end)
+				return 0;
+			timeout = (end - now + NSEC_PER_MSEC - 1) /
+				  NSEC_PER_MSEC;
+		}
+	}
+
+	return poll(pfd, 1, timeout);
+}
+
+static void ser_read(int fd)
+{
+	ssize_t n;
+
+	n = read(fd, rx_buf, sizeof(rx_buf));
+	if (!n) {
+		pr_err("No data\n");
+		exit(-1);
+	}
+
+	if (n < 0) {
+		pr_err("Read error: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	rx_pos = 0;
+	rx_len = n;
+
+	if (opt_rx_stats) {
+		uint64_t now = get_time_ns();
+
+		if (rx_stats.last)
+			hist_add(&rx_stats.gap, now - rx_stats.last);
+		rx_stats.last = now;
+		hist_add(&rx_stats.size, n);
+		rx_stats.bytes += n;
+	}
+
+	pr_debug("Read %zd bytes\n", n);
+	if (opt_debug > 1)
+		pr_hexdump(rx_buf, n);
+}
+
 static int ser_getc(int fd)
 {
-	static unsigned char buf[BUF_SIZE];
-	static unsigned int pos;
 	struct pollfd pfd;
-	static ssize_t n;
 	int res;
 
-	if (pos >= n) {
-		pfd.fd = fd;
-		pfd.events = POLLIN;
-		pfd.revents = 0;
-		res = poll(&pfd, 1, opt_timeout);
-		pr_debug("poll() returned %d errno %d revents 0x%x\n", res,
-			 errno, pfd.revents);
+	if (rx_pos >= rx_len) {
+		// Signal handlers (e.g. --stream's) only set a flag for later
+		do {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			res = ser_poll(&pfd);
+			pr_debug("poll() returned %d errno %d revents 0x%x\n",
+				 res, errno, pfd.revents);
+		} while (res < 0 && errno == EINTR);
 		if (res < 0) {
 			pr_err("Poll error: %s\n", strerror(errno));
 			exit(-1);
@@ -219,31 +603,21 @@ static int ser_getc(int fd)
 			exit(-1);
 		}
 
-		n = read(fd, buf, sizeof(buf));
-		if (!n) {
-			pr_err("No data\n");
-			exit(-1);
-		}
-
-		if (n < 0) {
-			pr_err("Read error: %s\n", strerror(errno));
-			exit(-1);
-		}
-
-		pos = 0;
-
-		pr_debug("Read %zd bytes\n", n);
-		if (opt_debug > 1)
-			pr_hexdump(buf, n);
+		ser_read(fd);
 	}
 
-	return buf[pos++];
+	return rx_buf[rx_pos++];
 }
 
-static char *ser_readline(int fd)
+/*
+ * Returns the next line including its newline, and its length, or NULL if
+ * the prompt was seen.  The line may contain NUL characters.
+ */
+static const char *ser_readline(int fd, size_t *len)
 {
 	static char line[LINE_SIZE];
-	unsigned int n = 0;
+	regmatch_t match;
+	size_t n = 0;
 	int c;
 
 	do {
@@ -257,18 +631,22 @@ static char *ser_readline(int fd)
 		}
 
 		line[n++] = c;
-		line[n] = '\0';
 
-		if (!regexec(&regex_prompt, line, 0, NULL, 0)) {
+		match.rm_so = 0;
+		match.rm_eo = n;
+		if (!regexec(&regex_prompt, line, 1, &match, REG_STARTEND)) {
 			pr_debug("Prompt seen, end of data\n");
+			memcpy(prompt_seen, line, n);
+			prompt_seen_len = n;
 			return NULL;
 		}
 	} while (c != '\n');
 
+	*len = n;
 	return line;
 }
 
-static const char *join_words(char *words[], size_t nwords, size_t *len_out)
+const char *join_words(char *words[], size_t nwords, size_t *len_out)
 {
 	unsigned int i, j;
 	size_t len;
@@ -299,12 +677,806 @@ static const char *join_words(char *words[], size_t nwords, size_t *len_out)
 	return line;
 }
 
-int main(int argc, char *argv[])
+void prompt_init(const char *prompt)
+{
+	int ret;
+
+	ret = regcomp(&regex_prompt, prompt, REG_NOSUB);
+	if (ret) {
+		char errbuf[256];
+
+		regerror(ret, &regex_prompt, errbuf, sizeof(errbuf));
+		pr_err("Failed to compile prompt regex: %s\n", errbuf);
+		exit(-1);
+	}
+}
+
+static void timing_report(void)
+{
+	char write[16], drain[16], echo[16], prompt[16], resp[16];
+
+	if (timing.drain) {
+		format_ns(drain, sizeof(drain), timing.drain - timing.start);
+		format_ns(resp, sizeof(resp), timing.prompt - timing.drain);
+	} else {
+		strcpy(drain, "?");
+		strcpy(resp, "?");
+	}
+
+	pr_err("Timing: write %s, last byte on wire %s, echo %s, prompt %s "
+	       "(%s after last byte)\n",
+	       format_ns(write, sizeof(write), timing.write - timing.start),
+	       drain, format_ns(echo, sizeof(echo), timing.echo - timing.start),
+	       format_ns(prompt, sizeof(prompt), timing.prompt - timing.start),
+	       resp);
+}
+
+static void rx_stats_report(void)
+{
+	uint64_t reads = hist_total(&rx_stats.size);
+	char byte_time[16];
+
+	pr_err("Received %llu bytes in %llu reads (buffer size %u)\n",
+	       (unsigned long long)rx_stats.bytes, (unsigned long long)reads,
+	       BUF_SIZE);
+	if (ser_baud)
+		pr_err("At %u baud, %u bits per character, one byte takes %s\n",
+		       ser_baud, ser_char_bits,
+		       format_ns(byte_time, sizeof(byte_time),
+				 ser_char_bits * NSEC_PER_SEC / ser_baud));
+	if (!reads)
+		return;
+
+	pr_err("Read size (bytes):\n");
+	hist_print(&rx_stats.size, hist_format_count);
+	if (reads > 1) {
+		pr_err("Inter-read gap:\n");
+		hist_print(&rx_stats.gap, format_ns);
+	}
+}
+
+/* Print a response, prefixing each line with a timestamp and optional tag */
+void output_record(FILE *out, uint64_t ts, const char *tag, const char *buf,
+		   size_t len)
+{
+	const char *end = buf + len, *nl;
+
+	while (buf < end) {
+		nl = memchr(buf, '\n', end - buf);
+		nl = nl ? nl + 1 : end;
+		fprintf(out, "%llu.%06llu ", ts / NSEC_PER_SEC,
+			(ts % NSEC_PER_SEC) / NSEC_PER_USEC);
+		if (tag)
+			fprintf(out, "%s ", tag);
+		fwrite(buf, 1, nl - buf, out);
+		if (nl[-1] != '\n')
+			fputc('\n', out);
+		buf = nl;
+	}
+}
+
+int mcu_open(const char *dev)
+{
+	const char *db = mock_db(dev);
+	int fd;
+
+	mcu_dev = dev;
+	trace_process(dev);
+	if (db)
+		return mock_open(db);
+
+	stats_open(dev);
+	if (!opt_force)
+		stats_check_health();
+	fd = ser_open(dev, O_RDWR | O_NOCTTY, 0);
+	stats_busy_begin();
+
+	return fd;
+}
+
+/* Like mcu_open(), but returns -1 immediately if the port is busy */
+int mcu_try_open(const char *dev)
+{
+	const char *db = mock_db(dev);
+	int fd;
+
+	mcu_dev = dev;
+	trace_process(dev);
+	if (db)
+		return mock_open(db);
+
+	stats_open(dev);
+	fd = ser_open(dev, O_RDWR | O_NOCTTY, 1);
+	if (fd >= 0)
+		stats_busy_begin();
+
+	return fd;
+}
+
+struct lock_dev {
+	const char *dev;
+	unsigned int idx;
+	dev_t rdev, fsdev;
+	ino_t ino;
+};
+
+/* Canonical lock order: by device number, then by file for non-devices */
+static int lock_dev_cmp(const void *a, const void *b)
+{
+	const struct lock_dev *x = a, *y = b;
+
+	if (x->rdev != y->rdev)
+		return x->rdev < y->rdev ? -1 : 1;
+	if (x->fsdev != y->fsdev)
+		return x->fsdev < y->fsdev ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Lock a group of devices, all or nothing.  Locks are taken in a global
+ * canonical order, so concurrent instances locking overlapping groups
+ * cannot deadlock, and all waits share a single deadline.  On timeout, the
+ * locks already taken are released by exiting.  Mock devices are not locked,
+ * and get fd -1.
+ */
+void mcu_lock_group(const char * const devs[], unsigned int n, int fds[])
+{
+	struct lock_dev *locks;
+	struct timeval tv;
+	struct stat st;
+	unsigned int i, nlocks = 0;
+	uint64_t t0;
+
+	locks = malloc(n * sizeof(*locks));
+	if (!locks) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		fds[i] = -1;
+		if (mock_db(devs[i]))
+			continue;
+
+		if (stat(devs[i], &st)) {
+			pr_err("Failed to open %s: %s\n", devs[i],
+			       strerror(errno));
+			exit(-1);
+		}
+		locks[nlocks].dev = devs[i];
+		locks[nlocks].idx = i;
+		locks[nlocks].rdev = st.st_rdev;
+		locks[nlocks].fsdev = st.st_dev;
+		locks[nlocks].ino = st.st_ino;
+		nlocks++;
+	}
+
+	qsort(locks, nlocks, sizeof(*locks), lock_dev_cmp);
+	for (i = 1; i < nlocks; i++) {
+		if (!lock_dev_cmp(&locks[i - 1], &locks[i])) {
+			pr_err("%s and %s are the same device\n",
+			       locks[i - 1].dev, locks[i].dev);
+			exit(-1);
+		}
+	}
+
+	ser_drop_caps();
+
+	t0 = get_time_ns();
+	timeout_init(&tv);
+	for (i = 0; i < nlocks; i++)
+		fds[locks[i].idx] = ser_lock(locks[i].dev,
+					     O_RDWR | O_NOCTTY, 0, &tv);
+	trace_span("lock wait", t0, get_time_ns(), NULL, 0);
+
+	free(locks);
+}
+
+/* Like mcu_open(), but for a device locked by mcu_lock_group() */
+int mcu_open_locked(const char *dev, int fd)
+{
+	uint64_t t0;
+
+	if (fd < 0)
+		return mcu_open(dev);
+
+	mcu_dev = dev;
+	trace_process(dev);
+	stats_open(dev);
+	if (!opt_force)
+		stats_check_health();
+	t0 = get_time_ns();
+	ser_setup(fd);
+	trace_span("open", t0, get_time_ns(), NULL, 0);
+	stats_busy_begin();
+
+	return fd;
+}
+
+void mcu_close(int fd)
+{
+	stats_busy_end();
+
+	if (opt_rx_stats) {
+		fflush(stdout);
+		rx_stats_report();
+	}
+
+	close(fd);
+	mock_close();
+}
+
+static void mcu_send(int fd, const char *cmd, size_t len)
+{
+	ssize_t n;
+
+	pr_debug("Sending command...\n");
+	n = write(fd, cmd, len);
+	if (n < 0) {
+		pr_err("Write error: %s\n", strerror(errno));
+		exit(-1);
+	}
+	if (n < len) {
+		pr_err("Short write %zd < %zu\n", n, len);
+		exit(-1);
+	}
+}
+
+static void mcu_wait_echo(int fd, const char *cmd, size_t len)
+{
+	const char *line;
+	struct timeval tv;
+	size_t n;
+
+	pr_debug("Waiting for command echo...\n");
+	timeout_init(&tv);
+	while (1) {
+		line = ser_readline(fd, &n);
+		if (line && memmem(line, n, cmd, len))
+			break;
+
+		if (!line || timed_out(&tv)) {
+			pr_err("Command echo not found\n");
+			exit(-1);
+		}
+		pr_debug("Ignoring %.*s", (int)n, line);
+	}
+	pr_debug("Command echo found.\n");
+}
+
+/* Parse a stop sequence, with "^X" for control characters, and "\xHH" */
+static size_t parse_stop(const char *s, char *buf, size_t size)
+{
+	size_t n = 0;
+	char *end;
+
+	for (; *s && n < size; n++) {
+		if (s[0] == '^' && s[1]) {
+			buf[n] = s[1] == '?' ? 0x7f : s[1] & 0x1f;
+			s += 2;
+		} else if (s[0] == '\\' && s[1] == 'x') {
+			buf[n] = strtoul(s + 2, &end, 16);
+			s = end;
+		} else if (s[0] == '\\' && s[1] == 'n') {
+			buf[n] = '\n';
+			s += 2;
+		} else if (s[0] == '\\' && s[1] == 'r') {
+			buf[n] = '\r';
+			s += 2;
+		} else {
+			buf[n] = *s++;
+		}
+	}
+
+	return n;
+}
+
+/* Abort the current command using the stop sequence, and resynchronize */
+void mcu_stop(int fd)
+{
+	struct timeval tv;
+	char stop[64];
+	size_t n;
+
+	pr_debug("Stopping command...\n");
+	mcu_send(fd, stop, parse_stop(opt_stop, stop, sizeof(stop)));
+
+	timeout_init(&tv);
+	while (ser_readline(fd, &n)) {
+		if (timed_out(&tv)) {
+			pr_err("Prompt not found after stopping command\n");
+			exit(-1);
+		}
+	}
+}
+
+static void mcu_read_response(int fd, FILE *out)
 {
-	const char *cmd, *line;
+	const char *line;
 	struct timeval tv;
-	int ret, fd;
-	ssize_t out;
+	size_t n;
+
+	timeout_init(&tv);
+	while (1) {
+		line = ser_readline(fd, &n);
+		if (!line)
+			break;
+
+		if (timed_out(&tv)) {
+			pr_err("Response too long\n");
+			exit(-1);
+		}
+
+		// Stop as soon as the output is known to be bad or unwanted,
+		// e.g. when the reader of a pipe went away
+		fwrite(line, 1, n, out);
+		if (ferror(out)) {
+			mcu_stop(fd);
+			break;
+		}
+	}
+}
+
+static void mcu_response(int fd, const char *cmd, size_t len, FILE *out,
+			 uint64_t start)
+{
+	size_t size;
+	char *buf;
+	FILE *f;
+
+	if (!mock_recording()) {
+		mcu_read_response(fd, out);
+		return;
+	}
+
+	f = open_memstream(&buf, &size);
+	if (!f) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	mcu_read_response(fd, f);
+	fclose(f);
+
+	fwrite(buf, 1, size, out);
+	mock_record(cmd, len, buf, size, prompt_seen, prompt_seen_len,
+		    get_time_ns() - start);
+	free(buf);
+}
+
+/* Send wire instead of cmd, e.g. an alias, but account for cmd */
+static uint64_t mcu_cmd_as(int fd, const char *cmd, size_t len,
+			   const char *wire, size_t wirelen, FILE *out)
+{
+	uint64_t ts;
+
+	stats_cmd_begin(cmd, len);
+
+	memset(&timing, 0, sizeof(timing));
+	timing.start = get_time_ns();
+	mcu_send(fd, wire, wirelen);
+	timing.write = get_time_ns();
+
+	if (opt_timing) {
+		tx_draining = 1;
+		tx_drain_check(fd);
+	}
+
+	mcu_wait_echo(fd, wire, wirelen);
+	timing.echo = get_time_ns();
+	ts = get_realtime_ns();
+
+	mcu_response(fd, cmd, len, out, timing.start);
+
+	timing.prompt = get_time_ns();
+	if (tx_draining)
+		tx_drain_check(fd);
+	tx_draining = 0;
+
+	stats_cmd_end(timing.prompt - timing.start);
+
+	if (trace_enabled()) {
+		trace_span("command", timing.start, timing.prompt, cmd, len);
+		trace_span("write", timing.start, timing.write, NULL, 0);
+		trace_span("echo wait", timing.write, timing.echo, NULL, 0);
+		trace_span("response", timing.echo, timing.prompt, NULL, 0);
+	}
+
+	if (opt_timing) {
+		fflush(out);
+		timing_report();
+	}
+
+	return ts;
+}
+
+/* Returns the (real) time the response started */
+uint64_t mcu_cmd(int fd, const char *cmd, size_t len, FILE *out)
+{
+	return mcu_cmd_as(fd, cmd, len, cmd, len, out);
+}
+
+/* alias-cmd is a printf() format, taking exactly the name and the command */
+static int alias_fmt_valid(const char *fmt)
+{
+	unsigned int n = 0;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%')
+			continue;
+		if (*++fmt == '%')
+			continue;
+		if (*fmt != 's')
+			return 0;
+		n++;
+	}
+
+	return n == 2;
+}
+
+/*
+ * Define the alias for cmd from the device's profile on the MCU, and return
+ * the command to send instead, or NULL if there is none.
+ */
+static char *mcu_alias(int fd, const char *cmd, size_t len, size_t *wirelen)
+{
+	char def[LINE_SIZE], *full, *wire, *buf;
+	const char *fmt, *name;
+	size_t size;
+	FILE *out;
+	int n;
+
+	while (len && (cmd[len - 1] == '\n' || cmd[len - 1] == '\r'))
+		len--;
+	name = profile_alias(cmd, len);
+	if (!name)
+		return NULL;
+
+	fmt = profile_get("alias-cmd");
+	if (!fmt) {
+		pr_err("No alias-cmd in profile for %s\n", mcu_dev);
+		exit(-1);
+	}
+	if (!alias_fmt_valid(fmt)) {
+		pr_err("Invalid alias-cmd \"%s\", need two %%s conversions\n",
+		       fmt);
+		exit(-1);
+	}
+
+	full = strndup(cmd, len);
+	if (!full) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	// Quoting rules differ per MCU, so reject instead of escaping
+	if (strpbrk(name, "'\"\\") || strpbrk(full, "'\"\\")) {
+		pr_err("Cannot define alias %s for a command with quotes\n",
+		       name);
+		exit(-1);
+	}
+	n = snprintf(def, sizeof(def) - 1, fmt, name, full);
+	free(full);
+	if (n < 0 || n >= sizeof(def) - 1) {
+		pr_err("Alias definition too long\n");
+		exit(-1);
+	}
+	def[n++] = '\n';
+
+	out = open_memstream(&buf, &size);
+	if (!out) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	pr_debug("Defining alias %s...\n", name);
+	mcu_cmd(fd, def, n, out);
+	fclose(out);
+	pr_debug("%s", buf);
+	free(buf);
+
+	*wirelen = strlen(name) + 1;
+	wire = malloc(*wirelen + 1);
+	if (!wire) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	sprintf(wire, "%s\n", name);
+
+	return wire;
+}
+
+/*
+ * Execute a series of commands, with up to window commands in flight, hiding
+ * the round-trip time.  The MCU must be able to buffer the input of all
+ * outstanding commands.  Without a record callback, responses are printed as
+ * they are received.
+ */
+void mcu_pipeline(int fd, const char * const cmds[], const size_t lens[],
+		  unsigned int n, unsigned int window, record_fn *record,
+		  void *arg)
+{
+	uint64_t sent[MAX_WINDOW], echo, now;
+	unsigned int i, next = 0;
+	FILE *out = stdout;
+	size_t size;
+	char *buf;
+
+	if (!window)
+		window = 1;
+	if (window > MAX_WINDOW)
+		window = MAX_WINDOW;
+
+	for (i = 0; i < n; i++) {
+		for (; next < n && next < i + window; next++) {
+			sent[next % window] = get_time_ns();
+			mcu_send(fd, cmds[next], lens[next]);
+		}
+
+		stats_cmd_begin(cmds[i], lens[i]);
+		mcu_wait_echo(fd, cmds[i], lens[i]);
+		echo = get_time_ns();
+		if (record) {
+			out = open_memstream(&buf, &size);
+			if (!out) {
+				pr_err("Failed to allocate buffer: %s\n",
+				       strerror(errno));
+				exit(-1);
+			}
+		}
+		mcu_response(fd, cmds[i], lens[i], out, sent[i % window]);
+		now = get_time_ns();
+		stats_cmd_end(now - sent[i % window]);
+		if (record) {
+			fclose(out);
+			record(get_realtime_ns(), buf, size, arg);
+			free(buf);
+		}
+
+		// Commands in flight overlap, so give each slot its own track
+		trace_lane(i % window);
+		trace_span("command", sent[i % window], now, cmds[i], lens[i]);
+		trace_span("echo wait", sent[i % window], echo, NULL, 0);
+		trace_span("response", echo, now, NULL, 0);
+	}
+	trace_lane(0);
+}
+
+void mcu_exec(const char *dev, const char *cmd, size_t len)
+{
+	int fd;
+
+	fd = mcu_open(dev);
+	mcu_cmd(fd, cmd, len, stdout);
+	mcu_close(fd);
+}
+
+void sleep_until(uint64_t t)
+{
+	struct timespec ts = {
+		.tv_sec = t / NSEC_PER_SEC,
+		.tv_nsec = t % NSEC_PER_SEC,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static uint64_t repeat_interval(uint64_t min)
+{
+	uint64_t interval = opt_interval * NSEC_PER_MSEC;
+
+	return interval < min ? min : interval;
+}
+
+/*
+ * Execute a command --count times every --interval ms on an open port, but
+ * not faster than the minimum interval in the profile.  Without a record
+ * callback, responses are printed as they are received.  In adaptive mode,
+ * the interval is adjusted after each recorded response.
+ */
+void mcu_repeat(int fd, const char *cmd, size_t len, record_fn *record,
+		void *arg)
+{
+	uint64_t next, now, ts, min = 0;
+	char *buf, *wire = NULL;
+	size_t size, wirelen, n;
+	unsigned int i;
+	FILE *out;
+
+	if (opt_count != 1) {
+		profile_load(mcu_dev);
+		for (n = len; n && (cmd[n - 1] == '\n' || cmd[n - 1] == '\r');
+		     n--)
+			;
+		min = profile_min_interval(cmd, n);
+		if (min > opt_interval * NSEC_PER_MSEC)
+			pr_debug("Limiting interval to %llu us\n",
+				 min / NSEC_PER_USEC);
+	}
+
+	// Aliases only pay off when the command is repeated
+	if (opt_aliases && opt_count != 1)
+		wire = mcu_alias(fd, cmd, len, &wirelen);
+	if (!wire) {
+		wire = (char *)cmd;
+		wirelen = len;
+	}
+
+	next = get_time_ns();
+	for (i = 0; !opt_count || i < opt_count; i++) {
+		if (i) {
+			now = get_time_ns();
+			// Don't try to catch up after an overrun
+			if (next + repeat_interval(min) < now)
+				next = now;
+			else
+				sleep_until(next);
+		}
+
+		if (record) {
+			out = open_memstream(&buf, &size);
+			if (!out) {
+				pr_err("Failed to allocate buffer: %s\n",
+				       strerror(errno));
+				exit(-1);
+			}
+			ts = mcu_cmd_as(fd, cmd, len, wire, wirelen, out);
+			fclose(out);
+			record(ts, buf, size, arg);
+			if (adapt_enabled())
+				opt_interval = adapt_update(opt_interval, buf,
+							    size);
+			free(buf);
+		} else {
+			mcu_cmd_as(fd, cmd, len, wire, wirelen,
+				   data_out ? data_out : stdout);
+		}
+
+		// Nobody is reading the output anymore
+		if (ferror(data_out ? data_out : stdout))
+			break;
+
+		next += repeat_interval(min);
+	}
+
+	if (wire != cmd)
+		free(wire);
+}
+
+static volatile sig_atomic_t stream_stopped;
+
+static void stream_signal(int sig)
+{
+	stream_stopped = 1;
+}
+
+static void stream_output(const char *line, size_t n)
+{
+	if (data_out)
+		fwrite(line, 1, n, data_out);
+	else if (opt_timestamps)
+		output_record(stdout, get_realtime_ns(), NULL, line, n);
+	else
+		fwrite(line, 1, n, stdout);
+}
+
+/*
+ * Forward the output of a command that does not return to the prompt, until
+ * --duration or --bytes is reached, or SIGINT or SIGTERM is received.  Then
+ * send the stop sequence, and resynchronize on the prompt.
+ */
+static void mcu_stream(int fd, const char *cmd, size_t len)
+{
+	struct sigaction sa = { .sa_handler = stream_signal };
+	uint64_t start, end = 0, now;
+	unsigned long long bytes = 0;
+	char line[LINE_SIZE];
+	regmatch_t match;
+	struct pollfd pfd;
+	int timeout, res;
+	size_t n = 0;
+
+	/*
+	 * No SA_RESTART, to interrupt poll().  A signal during the echo wait
+	 * stops the command as soon as it has started.
+	 */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	stats_cmd_begin(cmd, len);
+	start = get_time_ns();
+	mcu_send(fd, cmd, len);
+	mcu_wait_echo(fd, cmd, len);
+
+	if (opt_duration > 0)
+		end = get_time_ns() + opt_duration * NSEC_PER_MSEC;
+
+	while (!stream_stopped) {
+		if (rx_pos >= rx_len) {
+			fflush(stdout);
+
+			timeout = -1;
+			if (end) {
+				now = get_time_ns();
+				if (now >= end)
+					break;
+				timeout = (end - now + NSEC_PER_MSEC - 1) /
+					  NSEC_PER_MSEC;
+			}
+
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			res = poll(&pfd, 1, timeout);
+			if (res < 0 && errno != EINTR) {
+				pr_err("Poll error: %s\n", strerror(errno));
+				exit(-1);
+			}
+			if (res <= 0)
+				continue;
+
+			ser_read(fd);
+		}
+
+		line[n] = rx_buf[rx_pos++];
+		if (line[n] == '\r')
+			continue;
+		bytes++;
+		n++;
+
+		// The command may still finish on its own
+		match.rm_so = 0;
+		match.rm_eo = n;
+		if (!regexec(&regex_prompt, line, 1, &match, REG_STARTEND)) {
+			pr_debug("Prompt seen, end of data\n");
+			n = 0;
+			goto done;
+		}
+
+		if (line[n - 1] == '\n' || n == sizeof(line)) {
+			stream_output(line, n);
+			n = 0;
+			if (ferror(data_out ? data_out : stdout))
+				break;
+		}
+
+		if (opt_bytes && bytes >= opt_bytes)
+			break;
+	}
+
+	if (n)
+		stream_output(line, n);
+	fflush(stdout);
+
+	pr_debug("Stopping stream after %llu bytes...\n", bytes);
+	mcu_stop(fd);
+
+done:
+	now = get_time_ns();
+	stats_cmd_end(now - start);
+	trace_span("command", start, now, cmd, len);
+
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static void record_print(uint64_t ts, const char *buf, size_t len, void *arg)
+{
+	char rate[32];
+
+	output_record(stdout, ts, adapt_enabled() ?
+		      adapt_format_rate(rate, sizeof(rate), opt_interval) :
+		      NULL, buf, len);
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, lock_fds[2 * MAX_DEVS], res;
+	const char *cmd;
+	unsigned int i;
 	size_t len;
 
 	while (argc > 1 && argv[1][0] == '-') {
@@ -316,6 +1488,30 @@ int main(int argc, char *argv[])
 		} else if (!strcmp(argv[1], "-f") ||
 			   !strcmp(argv[1], "--force")) {
 			opt_force = 1;
+		} else if (!strcmp(argv[1], "-T") ||
+			   !strcmp(argv[1], "--timing")) {
+			opt_timing = 1;
+		} else if (!strcmp(argv[1], "-R") ||
+			   !strcmp(argv[1], "--rx-stats")) {
+			opt_rx_stats = 1;
+		} else if (!strcmp(argv[1], "-S") ||
+			   !strcmp(argv[1], "--timestamps")) {
+			opt_timestamps = 1;
+		} else if (!strcmp(argv[1], "-A") ||
+			   !strcmp(argv[1], "--aliases")) {
+			opt_aliases = 1;
+		} else if (!strcmp(argv[1], "-m") ||
+			   !strcmp(argv[1], "--merge")) {
+			opt_merge = 1;
+		} else if (!strcmp(argv[1], "--stream")) {
+			opt_stream = 1;
+		} else if (!strcmp(argv[1], "-Z") ||
+			   !strcmp(argv[1], "--unpack")) {
+			opt_unpack = 1;
+		} else if (!strcmp(argv[1], "--calibrate")) {
+			opt_calibrate = 1;
+		} else if (!strcmp(argv[1], "--top")) {
+			opt_top = 1;
 		} else if (!strcmp(argv[1], "--")) {
 			argv++;
 			argc--;
@@ -323,13 +1519,91 @@ int main(int argc, char *argv[])
 		} else if (argc > 2) {
 			if (!strcmp(argv[1], "-s") ||
 			    !strcmp(argv[1], "--device")) {
-				opt_dev = argv[2];
+				if (opt_ndevs >= MAX_DEVS) {
+					pr_err("Too many devices\n");
+					exit(-1);
+				}
+				opt_devs[opt_ndevs++] = argv[2];
+			} else if (!strcmp(argv[1], "-L") ||
+				   !strcmp(argv[1], "--lock")) {
+				if (opt_nlocks >= MAX_DEVS) {
+					pr_err("Too many devices\n");
+					exit(-1);
+				}
+				opt_locks[opt_nlocks++] = argv[2];
 			} else if (!strcmp(argv[1], "-p") ||
 				   !strcmp(argv[1], "--prompt")) {
 				opt_prompt = argv[2];
 			} else if (!strcmp(argv[1], "-t") ||
 			    !strcmp(argv[1], "--timeout")) {
 				opt_timeout = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "-i") ||
+				   !strcmp(argv[1], "--interval")) {
+				opt_interval = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "-k") ||
+				   !strcmp(argv[1], "--keepalive")) {
+				opt_keepalive = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "--http")) {
+				opt_http = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "--serve")) {
+				opt_serve = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "--dump")) {
+				opt_dump = argv[2];
+			} else if (!strcmp(argv[1], "--base")) {
+				opt_dump_opts.base = strtoul(argv[2], NULL, 0);
+			} else if (!strcmp(argv[1], "--size")) {
+				opt_dump_opts.size = strtoul(argv[2], NULL, 0);
+			} else if (!strcmp(argv[1], "--block")) {
+				opt_dump_opts.block = strtoul(argv[2], NULL, 0);
+			} else if (!strcmp(argv[1], "--crc-cmd")) {
+				dump_check_fmt(argv[1], argv[2]);
+				opt_dump_opts.crc_cmd = argv[2];
+			} else if (!strcmp(argv[1], "--read-cmd")) {
+				dump_check_fmt(argv[1], argv[2]);
+				opt_dump_opts.read_cmd = argv[2];
+			} else if (!strcmp(argv[1], "--config")) {
+				opt_config = argv[2];
+			} else if (!strcmp(argv[1], "--check")) {
+				opt_check = argv[2];
+			} else if (!strcmp(argv[1], "--window")) {
+				opt_window = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "--reject")) {
+				opt_reject = argv[2];
+			} else if (!strcmp(argv[1], "--record")) {
+				opt_record = argv[2];
+			} else if (!strcmp(argv[1], "--trace")) {
+				opt_trace = argv[2];
+			} else if (!strcmp(argv[1], "-a") ||
+				   !strcmp(argv[1], "--adaptive")) {
+				opt_adaptive = argv[2];
+			} else if (!strcmp(argv[1], "--min-interval")) {
+				opt_min_interval = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "--headroom")) {
+				opt_headroom = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "--max-interval")) {
+				opt_max_interval = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "--duration")) {
+				opt_duration = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "--bytes")) {
+				opt_bytes = strtoull(argv[2], NULL, 0);
+			} else if (!strcmp(argv[1], "--stop")) {
+				opt_stop = argv[2];
+			} else if (!strcmp(argv[1], "--digest")) {
+				opt_digest = argv[2];
+			} else if (!strcmp(argv[1], "--expect-digest")) {
+				opt_expect_digest = argv[2];
+			} else if (!strcmp(argv[1], "--expect-size")) {
+				opt_expect_size = strtoull(argv[2], NULL, 0);
+			} else if (!strcmp(argv[1], "-n") ||
+				   !strcmp(argv[1], "--count")) {
+				opt_count = atoi(argv[2]);
+				opt_count_set = 1;
+			} else if (!strcmp(argv[1], "-w") ||
+				   !strcmp(argv[1], "--watermark")) {
+				opt_watermark = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "-j") ||
+				   !strcmp(argv[1], "--jobs")) {
+				opt_jobs = argv[2];
 			} else {
 				usage();
 			}
@@ -342,73 +1616,165 @@ int main(int argc, char *argv[])
 		argc--;
 	}
 
-	if (!opt_dev)
-		opt_dev = getenv(MCUXEQ_DEV_ENV);
+	if (!opt_ndevs && getenv(MCUXEQ_DEV_ENV))
+		opt_devs[opt_ndevs++] = getenv(MCUXEQ_DEV_ENV);
+	opt_dev = opt_devs[0];
 
 	if (!opt_prompt)
 		opt_prompt = getenv(MCUXEQ_PROMPT_ENV);
 	if (!opt_prompt)
 		opt_prompt = DEFAULT_PROMPT;
 
-	if (!opt_dev || argc <= 1)
-		usage();
+	// Output errors stop the command, so the MCU is left at the prompt
+	signal(SIGPIPE, SIG_IGN);
 
-	ret = regcomp(&regex_prompt, opt_prompt, REG_NOSUB);
-	if (ret) {
-		char errbuf[256];
+	if (opt_record)
+		mock_record_open(opt_record);
 
-		regerror(ret, &regex_prompt, errbuf, sizeof(errbuf));
-		pr_err("Failed to compile prompt regex: %s\n", errbuf);
-		exit(-1);
+	if (opt_trace)
+		trace_open(opt_trace);
+
+	if (opt_adaptive) {
+		if (opt_interval <= 0) {
+			pr_err("Adaptive mode needs a positive interval\n");
+			exit(-1);
+		}
+		if (!opt_min_interval)
+			opt_min_interval = (opt_interval + 7) / 8;
+		if (!opt_max_interval)
+			opt_max_interval = opt_interval * 8;
+		adapt_init(opt_adaptive, opt_min_interval, opt_max_interval);
 	}
 
-	cmd = join_words(argv + 1, argc - 1, &len);
+	if (opt_top) {
+		if (!opt_interval)
+			opt_interval = DEFAULT_TOP_INTERVAL_MS;
+		exit(top_run());
+	}
 
-	fd = ser_open(opt_dev, O_RDWR | O_NOCTTY);
+	if (opt_jobs)
+		exit(jobs_run(opt_jobs));
 
-	pr_debug("Sending command...\n");
-	out = write(fd, cmd, len);
-	if (out < 0) {
-		pr_err("Write error: %s\n", strerror(errno));
-		exit(-1);
+	if (opt_keepalive && opt_dev) {
+		prompt_init(opt_prompt);
+		if (argc > 1) {
+			cmd = join_words(argv + 1, argc - 1, &len);
+		} else {
+			cmd = "\n";
+			len = 1;
+		}
+		exit(keepalive_run(opt_devs, opt_ndevs, cmd, len,
+				   opt_keepalive));
 	}
-	if (out < len) {
-		pr_err("Short write %zd < %zu\n", out, len);
-		exit(-1);
+
+	if (opt_http && opt_dev) {
+		prompt_init(opt_prompt);
+		cmd = NULL;
+		len = 0;
+		if (argc > 1)
+			cmd = join_words(argv + 1, argc - 1, &len);
+		exit(http_run(opt_dev, opt_http, cmd, len));
 	}
 
-	pr_debug("Waiting for command echo...\n");
-	timeout_init(&tv);
-	while (1) {
-		line = ser_readline(fd);
-		if (line && strstr(line, cmd))
-			break;
+	if (opt_serve >= 0 && opt_dev) {
+		prompt_init(opt_prompt);
+		exit(serve_run(opt_dev, opt_serve));
+	}
 
-		if (!line || timed_out(&tv)) {
-			pr_err("Command echo not found\n");
+	if (opt_dump && opt_dev) {
+		prompt_init(opt_prompt);
+		exit(dump_run(opt_dev, opt_dump, &opt_dump_opts));
+	}
+
+	if (opt_config && opt_dev) {
+		prompt_init(opt_prompt);
+		exit(config_run(opt_dev, opt_config, opt_check, opt_reject,
+				 opt_window));
+	}
+
+	if (!opt_dev || argc <= 1)
+		usage();
+
+	prompt_init(opt_prompt);
+
+	cmd = join_words(argv + 1, argc - 1, &len);
+
+	if (opt_calibrate) {
+		if (opt_ndevs > 1) {
+			pr_err("Calibration supports a single device only\n");
 			exit(-1);
 		}
-		pr_debug("Ignoring %s", line);
+		exit(calib_run(opt_dev, cmd, len,
+			       opt_count_set ? opt_count : DEFAULT_CALIB_COUNT,
+			       opt_headroom));
 	}
 
-	pr_debug("Command echo found.\n");
+	for (i = 0; i < opt_nlocks; i++)
+		opt_devs[opt_ndevs + i] = opt_locks[i];
+	if (opt_ndevs > 1 || opt_nlocks)
+		mcu_lock_group(opt_devs, opt_ndevs + opt_nlocks, lock_fds);
+	else
+		lock_fds[0] = -1;
 
-	timeout_init(&tv);
-	while (1) {
-		line = ser_readline(fd);
-		if (!line)
-			break;
+	if (opt_stream && opt_ndevs > 1) {
+		pr_err("Streaming supports a single device only\n");
+		exit(-1);
+	}
 
-		if (timed_out(&tv)) {
-			pr_err("Response too long\n");
+	if (opt_expect_digest && !opt_digest) {
+		// Deduce the algorithm from the digest size
+		switch (strlen(opt_expect_digest)) {
+		case 8:
+			opt_digest = "crc32c";
+			break;
+		case 16:
+			opt_digest = "xxhash";
+			break;
+		case 64:
+			opt_digest = "sha256";
+			break;
+		}
+	}
+	if (opt_digest || opt_expect_digest || opt_expect_size) {
+		if (opt_ndevs > 1) {
+			pr_err("Digests support a single device only\n");
 			exit(-1);
 		}
-
-		printf("%s", line);
+		digest_out = digest_open(opt_digest ? opt_digest : "sha256",
+					 opt_expect_size);
+		data_out = digest_out;
+	}
+	if (opt_unpack) {
+		if (opt_ndevs > 1) {
+			pr_err("Decompression supports a single device only\n");
+			exit(-1);
+		}
+		unpack_out = unpack_open(digest_out ? digest_out : stdout);
+		data_out = unpack_out;
 	}
 
-	close(fd);
+	if (opt_ndevs > 1)
+		exit(merge_run(opt_devs, lock_fds, opt_ndevs, cmd, len,
+			       opt_merge ? opt_watermark : 0));
+
+	fd = mcu_open_locked(opt_dev, lock_fds[0]);
+	if (opt_stream)
+		mcu_stream(fd, cmd, len);
+	else
+		mcu_repeat(fd, cmd, len,
+			   !data_out && (opt_timestamps || adapt_enabled()) ?
+			   record_print : NULL, NULL);
+	mcu_close(fd);
+
 	regfree(&regex_prompt);
 
-	exit(0);
+	res = 0;
+	if (unpack_out)
+		res |= unpack_close(unpack_out);
+	if (digest_out)
+		res |= digest_close(digest_out, opt_expect_digest);
+	if (fflush(stdout) || ferror(stdout))
+		res |= 1;
+
+	exit(res);
 }
@@ -0,0 +1,62 @@
+/*
+ *  Microcontroller Command/Response Utility
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef MCUXEQ_H
+#define MCUXEQ_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define NSEC_PER_USEC		1000ULL
+#define NSEC_PER_MSEC		1000000ULL
+#define NSEC_PER_SEC		1000000000ULL
+
+#define MAX_WINDOW		64	/* Maximum commands in flight */
+#define LINE_SIZE		1024	/* Maximum command or response line */
+
+extern const char *opt_dev;
+extern const char *opt_prompt;
+extern int opt_timeout;
+extern int opt_debug;
+extern int opt_interval;
+extern unsigned int opt_count;
+
+#define pr_debug(fmt, ...)	{ if (opt_debug) printf(fmt, ##__VA_ARGS__); }
+#define pr_info(fmt, ...)	printf(fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+
+extern uint64_t get_time_ns(void);
+extern uint64_t get_realtime_ns(void);
+extern const char *format_ns(char *buf, size_t size, uint64_t ns);
+extern void sleep_until(uint64_t t);
+
+extern const char *join_words(char *words[], size_t nwords, size_t *len_out);
+extern void prompt_init(const char *prompt);
+
+/* Called with the receive timestamp and the full response of a command */
+typedef void record_fn(uint64_t ts, const char *buf, size_t len, void *arg);
+
+extern void output_record(FILE *out, uint64_t ts, const char *tag,
+			  const char *buf, size_t len);
+extern int mcu_open(const char *dev);
+extern int mcu_try_open(const char *dev);
+extern void mcu_lock_group(const char * const devs[], unsigned int n,
+			   int fds[]);
+extern int mcu_open_locked(const char *dev, int fd);
+extern void mcu_close(int fd);
+extern uint64_t mcu_cmd(int fd, const char *cmd, size_t len, FILE *out);
+extern void mcu_stop(int fd);
+extern void mcu_pipeline(int fd, const char * const cmds[],
+			 const size_t lens[], unsigned int n,
+			 unsigned int window, record_fn *record, void *arg);
+extern void mcu_exec(const char *dev, const char *cmd, size_t len);
+extern void mcu_repeat(int fd, const char *cmd, size_t len, record_fn *record,
+		       void *arg);
+
+#endif /* MCUXEQ_H */
@@ -0,0 +1,318 @@
+/*
+ *  Multi-device execution with timestamp ordered output
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  Each device is handled by a child process, which passes timestamped
+ *  responses through a pipe.  The parent merges these streams: a record is
+ *  output as soon as every other active device has a later record pending,
+ *  or when it is older than the watermark, bounding the output latency.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "mcuxeq.h"
+#include "adapt.h"
+#include "merge.h"
+
+struct merge_hdr {
+	uint64_t ts;
+	uint64_t len;
+	int64_t interval;
+};
+
+struct merge_rec {
+	struct merge_rec *next;
+	uint64_t ts;
+	size_t len;
+	int interval;			/* Effective interval in adaptive mode */
+	char buf[];
+};
+
+struct merge_src {
+	const char *dev;
+	pid_t pid;
+	int fd;				/* -1 at end of stream */
+	char *rx;
+	size_t rxlen, rxsize;
+	struct merge_rec *head, *tail;
+};
+
+static struct merge_src *merge_srcs;
+static unsigned int merge_nsrcs;
+static uint64_t merge_last;		/* Timestamp of the last output */
+static unsigned long merge_late;
+
+static void *merge_alloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	return p;
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("Write error: %s\n", strerror(errno));
+			exit(-1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void merge_send(uint64_t ts, const char *buf, size_t len, void *arg)
+{
+	struct merge_hdr hdr = {
+		.ts = ts,
+		.len = len,
+		.interval = opt_interval,
+	};
+	int fd = *(int *)arg;
+
+	write_all(fd, &hdr, sizeof(hdr));
+	write_all(fd, buf, len);
+}
+
+static void merge_parse(struct merge_src *src)
+{
+	struct merge_rec *rec;
+	struct merge_hdr hdr;
+	size_t n;
+
+	while (src->rxlen >= sizeof(hdr)) {
+		memcpy(&hdr, src->rx, sizeof(hdr));
+		n = sizeof(hdr) + hdr.len;
+		if (src->rxlen < n)
+			break;
+
+		rec = merge_alloc(NULL, sizeof(*rec) + hdr.len);
+		rec->next = NULL;
+		rec->ts = hdr.ts;
+		rec->len = hdr.len;
+		rec->interval = hdr.interval;
+		memcpy(rec->buf, src->rx + sizeof(hdr), hdr.len);
+		if (src->tail)
+			src->tail->next = rec;
+		else
+			src->head = rec;
+		src->tail = rec;
+
+		src->rxlen -= n;
+		memmove(src->rx, src->rx + n, src->rxlen);
+	}
+}
+
+static void merge_read(struct merge_src *src)
+{
+	ssize_t n;
+
+	if (src->rxsize - src->rxlen < 4096) {
+		src->rxsize = src->rxsize * 2 + 4096;
+		src->rx = merge_alloc(src->rx, src->rxsize);
+	}
+
+	n = read(src->fd, src->rx + src->rxlen, src->rxsize - src->rxlen);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		pr_err("Read error: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	if (!n) {
+		close(src->fd);
+		src->fd = -1;
+		return;
+	}
+
+	src->rxlen += n;
+	merge_parse(src);
+}
+
+/*
+ * Output all records that can no longer be preceded by another record.
+ * Returns the time in ms until the oldest pending record expires, or -1.
+ */
+static int merge_emit(uint64_t now, uint64_t watermark)
+{
+	char tag[PATH_MAX + 32], rate[32];
+	struct merge_src *src, *min;
+	struct merge_rec *rec;
+	unsigned int i, complete;
+
+	while (1) {
+		min = NULL;
+		complete = 1;
+		for (i = 0; i < merge_nsrcs; i++) {
+			src = &merge_srcs[i];
+			if (!src->head) {
+				if (src->fd >= 0)
+					complete = 0;
+				continue;
+			}
+			if (!min || src->head->ts < min->head->ts)
+				min = src;
+		}
+
+		if (!min)
+			return -1;
+
+		if (!complete && now < min->head->ts + watermark)
+			return (min->head->ts + watermark - now +
+				NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+
+		rec = min->head;
+		min->head = rec->next;
+		if (!min->head)
+			min->tail = NULL;
+
+		if (rec->ts < merge_last)
+			merge_late++;
+		else
+			merge_last = rec->ts;
+
+		if (adapt_enabled()) {
+			snprintf(tag, sizeof(tag), "%s %s", min->dev,
+				 adapt_format_rate(rate, sizeof(rate),
+						   rec->interval));
+			output_record(stdout, rec->ts, tag, rec->buf, rec->len);
+		} else {
+			output_record(stdout, rec->ts, min->dev, rec->buf,
+				      rec->len);
+		}
+		free(rec);
+	}
+}
+
+/* Devices are locked by the caller, fds[] as returned by mcu_lock_group() */
+int merge_run(const char * const devs[], const int fds[], unsigned int ndevs,
+	      const char *cmd, size_t len, int watermark)
+{
+	struct pollfd *pfds;
+	struct merge_src *src, **active;
+	unsigned int i, j, n, failed = 0;
+	int pfd[2], fd, status, timeout, res;
+
+	merge_srcs = merge_alloc(NULL, ndevs * sizeof(*merge_srcs));
+	memset(merge_srcs, 0, ndevs * sizeof(*merge_srcs));
+	merge_nsrcs = ndevs;
+	pfds = merge_alloc(NULL, ndevs * sizeof(*pfds));
+	active = merge_alloc(NULL, ndevs * sizeof(*active));
+
+	for (i = 0; i < ndevs; i++) {
+		src = &merge_srcs[i];
+		src->dev = devs[i];
+
+		if (pipe(pfd)) {
+			pr_err("Failed to create pipe: %s\n", strerror(errno));
+			exit(-1);
+		}
+
+		// Don't duplicate pending output in the child
+		fflush(stdout);
+		fflush(stderr);
+
+		src->pid = fork();
+		if (src->pid < 0) {
+			pr_err("Failed to fork: %s\n", strerror(errno));
+			exit(-1);
+		}
+
+		if (!src->pid) {
+			close(pfd[0]);
+			// Other children hold the locks of their devices
+			for (j = i + 1; j < ndevs; j++)
+				if (fds[j] >= 0)
+					close(fds[j]);
+			fd = mcu_open_locked(src->dev, fds[i]);
+			mcu_repeat(fd, cmd, len, merge_send, &pfd[1]);
+			mcu_close(fd);
+			exit(0);
+		}
+
+		close(pfd[1]);
+		if (fds[i] >= 0)
+			close(fds[i]);
+		src->fd = pfd[0];
+	}
+
+	timeout = -1;
+	while (1) {
+		for (i = 0, n = 0; i < ndevs; i++) {
+			if (merge_srcs[i].fd < 0)
+				continue;
+			active[n] = &merge_srcs[i];
+			pfds[n].fd = merge_srcs[i].fd;
+			pfds[n].events = POLLIN;
+			pfds[n].revents = 0;
+			n++;
+		}
+
+		if (!n)
+			break;
+
+		res = poll(pfds, n, timeout);
+		if (res < 0 && errno != EINTR) {
+			pr_err("Poll error: %s\n", strerror(errno));
+			exit(-1);
+		}
+
+		for (i = 0; res > 0 && i < n; i++)
+			if (pfds[i].revents)
+				merge_read(active[i]);
+
+		timeout = merge_emit(get_realtime_ns(),
+				     watermark * NSEC_PER_MSEC);
+		fflush(stdout);
+	}
+
+	// All streams have ended, flush the remaining records in order
+	merge_emit(get_realtime_ns(), watermark * NSEC_PER_MSEC);
+	fflush(stdout);
+
+	for (i = 0; i < ndevs; i++) {
+		src = &merge_srcs[i];
+		if (waitpid(src->pid, &status, 0) < 0) {
+			pr_err("Failed to wait for %s: %s\n", src->dev,
+			       strerror(errno));
+			exit(-1);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			pr_err("%s failed\n", src->dev);
+			failed++;
+		}
+		if (src->rxlen)
+			pr_err("%s: Truncated record\n", src->dev);
+	}
+
+	if (merge_late)
+		pr_err("%lu records arrived later than the watermark\n",
+		       merge_late);
+
+	free(active);
+	free(pfds);
+	free(merge_srcs);
+
+	return failed ? -1 : 0;
+}
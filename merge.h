@@ -0,0 +1,19 @@
+/*
+ *  Multi-device execution with timestamp ordered output
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stddef.h>
+
+extern int merge_run(const char * const devs[], const int fds[],
+		     unsigned int ndevs, const char *cmd, size_t len,
+		     int watermark);
+
+#endif /* MERGE_H */
@@ -0,0 +1,309 @@
+/*
+ *  Mock devices serving recorded responses
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  A mock device is served by a child process, connected through a socket
+ *  pair instead of a serial port, so all modes work unchanged.  The child
+ *  echoes input, and answers commands from a session database:
+ *
+ *      # Comment
+ *      prompt <prompt>         Prompt to print (Default: "> ")
+ *      $ <command>             Start of a recording
+ *      @ <ms>                  Optional latency of the response
+ *      | <line>                Response line
+ *
+ *  If a command has been recorded multiple times, the recordings are served
+ *  in turn.  A command without recording closes the connection.  Sessions
+ *  with real devices can be recorded with "--record".
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "mcuxeq.h"
+#include "mock.h"
+
+#define MOCK_PROMPT		"> "
+#define MOCK_CMD_SIZE		1024
+
+struct mock_entry {
+	char *cmd;
+	char *resp;			/* With CRLF line endings */
+	size_t len;
+	uint64_t latency;
+	unsigned int served;
+};
+
+static struct mock_entry *mock_entries;
+static unsigned int mock_nentries;
+static char *mock_prompt;
+static pid_t mock_pid;
+static int mock_record_fd = -1;
+static int mock_record_prompt;		/* Record the prompt first */
+
+static void *mock_alloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	return p;
+}
+
+/* Returns the session database to use for dev, or NULL for a real device */
+const char *mock_db(const char *dev)
+{
+	const char *db = getenv(MCUXEQ_MOCK_ENV);
+
+	if (!strncmp(dev, MOCK_PREFIX, strlen(MOCK_PREFIX)))
+		return dev + strlen(MOCK_PREFIX);
+
+	return db && *db ? db : NULL;
+}
+
+static void mock_load(const char *pathname)
+{
+	struct mock_entry *e = NULL;
+	unsigned int lineno = 0;
+	char *line = NULL, *p;
+	size_t size = 0;
+	ssize_t len;
+	FILE *f;
+
+	f = fopen(pathname, "r");
+	if (!f) {
+		pr_err("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	while ((len = getline(&line, &size, f)) > 0) {
+		lineno++;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (!len || line[0] == '#')
+			continue;
+
+		if (!strncmp(line, "prompt ", 7)) {
+			free(mock_prompt);
+			mock_prompt = strdup(line + 7);
+		} else if (!strncmp(line, "$ ", 2)) {
+			mock_entries = mock_alloc(mock_entries,
+						  (mock_nentries + 1) *
+						  sizeof(*mock_entries));
+			e = &mock_entries[mock_nentries++];
+			memset(e, 0, sizeof(*e));
+			e->cmd = strdup(line + 2);
+		} else if (e && line[0] == '@') {
+			e->latency = strtod(line + 1, NULL) * NSEC_PER_MSEC;
+		} else if (e && line[0] == '|') {
+			// Responses may contain NUL characters
+			p = line + 1 + (line[1] == ' ');
+			len -= p - line;
+			e->resp = mock_alloc(e->resp, e->len + len + 2);
+			memcpy(e->resp + e->len, p, len);
+			e->len += len;
+			e->resp[e->len++] = '\r';
+			e->resp[e->len++] = '\n';
+		} else {
+			pr_err("%s:%u: Invalid line\n", pathname, lineno);
+			exit(-1);
+		}
+	}
+
+	free(line);
+	fclose(f);
+
+	if (!mock_prompt)
+		mock_prompt = strdup(MOCK_PROMPT);
+}
+
+static void mock_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Serve the least used recording of a command */
+static void mock_answer(int fd, const char *cmd)
+{
+	struct mock_entry *e, *best = NULL;
+	struct timespec ts;
+	unsigned int i;
+
+	for (i = 0; i < mock_nentries; i++) {
+		e = &mock_entries[i];
+		if (!strcmp(e->cmd, cmd) &&
+		    (!best || e->served < best->served))
+			best = e;
+	}
+
+	if (best) {
+		best->served++;
+		if (best->latency) {
+			ts.tv_sec = best->latency / NSEC_PER_SEC;
+			ts.tv_nsec = best->latency % NSEC_PER_SEC;
+			while (nanosleep(&ts, &ts) && errno == EINTR)
+				continue;
+		}
+		mock_write(fd, best->resp, best->len);
+	} else if (*cmd) {
+		// Hang up, so the command fails like with a dead device
+		pr_err("No recording for \"%s\"\n", cmd);
+		_exit(1);
+	}
+
+	mock_write(fd, mock_prompt, strlen(mock_prompt));
+}
+
+static void __attribute__ ((noreturn)) mock_serve(int fd)
+{
+	char buf[256], cmd[MOCK_CMD_SIZE];
+	size_t len = 0;
+	ssize_t i, n;
+
+	while (1) {
+		n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			_exit(0);
+
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\r')
+				continue;
+			if (buf[i] != '\n') {
+				if (len < sizeof(cmd) - 1)
+					cmd[len++] = buf[i];
+				mock_write(fd, &buf[i], 1);
+				continue;
+			}
+
+			mock_write(fd, "\r\n", 2);
+			cmd[len] = '\0';
+			len = 0;
+			mock_answer(fd, cmd);
+		}
+	}
+}
+
+int mock_open(const char *db)
+{
+	int sv[2];
+
+	pr_debug("Mocking device using %s...\n", db);
+	if (!mock_entries)
+		mock_load(db);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		pr_err("Failed to create socket pair: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	// Don't duplicate pending output in the child
+	fflush(stdout);
+	fflush(stderr);
+
+	mock_pid = fork();
+	if (mock_pid < 0) {
+		pr_err("Failed to fork: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	if (!mock_pid) {
+		close(sv[0]);
+		mock_serve(sv[1]);
+	}
+
+	close(sv[1]);
+	return sv[0];
+}
+
+void mock_close(void)
+{
+	if (mock_pid > 0)
+		waitpid(mock_pid, NULL, 0);
+	mock_pid = 0;
+}
+
+void mock_record_open(const char *pathname)
+{
+	mock_record_fd = open(pathname, O_WRONLY | O_CREAT | O_APPEND |
+					O_CLOEXEC, 0644);
+	if (mock_record_fd < 0) {
+		pr_err("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	mock_record_prompt = !lseek(mock_record_fd, 0, SEEK_END);
+}
+
+int mock_recording(void)
+{
+	return mock_record_fd >= 0;
+}
+
+/* Each recording is appended with a single write, for concurrent writers */
+void mock_record(const char *cmd, size_t len, const char *resp, size_t size,
+		 const char *prompt, size_t plen, uint64_t latency)
+{
+	const char *end = resp + size, *nl;
+	size_t recsize;
+	char *rec;
+	FILE *f;
+
+	f = open_memstream(&rec, &recsize);
+	if (!f) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	// A new session database starts with the device's prompt
+	if (mock_record_prompt && plen) {
+		fprintf(f, "prompt %.*s\n", (int)plen, prompt);
+		mock_record_prompt = 0;
+	}
+
+	while (len && (cmd[len - 1] == '\n' || cmd[len - 1] == '\r'))
+		len--;
+	fprintf(f, "$ %.*s\n@ %llu.%03llu\n", (int)len, cmd,
+		latency / NSEC_PER_MSEC,
+		(latency % NSEC_PER_MSEC) / NSEC_PER_USEC);
+	while (resp < end) {
+		nl = memchr(resp, '\n', end - resp);
+		if (!nl)
+			nl = end;
+		fputs("| ", f);
+		fwrite(resp, 1, nl - resp, f);
+		fputc('\n', f);
+		resp = nl + 1;
+	}
+	fclose(f);
+
+	if (write(mock_record_fd, rec, recsize) != recsize)
+		pr_err("Failed to record: %s\n", strerror(errno));
+	free(rec);
+}
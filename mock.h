@@ -0,0 +1,29 @@
+/*
+ *  Mock devices serving recorded responses
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef MOCK_H
+#define MOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MOCK_PREFIX		"mock://"
+#define MCUXEQ_MOCK_ENV		"MCUXEQ_MOCK"
+
+extern const char *mock_db(const char *dev);
+extern int mock_open(const char *db);
+extern void mock_close(void);
+
+extern void mock_record_open(const char *pathname);
+extern int mock_recording(void);
+extern void mock_record(const char *cmd, size_t len, const char *resp,
+			size_t size, const char *prompt, size_t plen,
+			uint64_t latency);
+
+#endif /* MOCK_H */
@@ -0,0 +1,301 @@
+/*
+ *  Per-device profiles
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  A profile holds settings for a single device, and is stored as
+ *  $XDG_CONFIG_HOME/mcuxeq/<canonical device path, with '/' as '_'>.profile.
+ *  Each line consists of a key and a value:
+ *
+ *      # Comment
+ *      alias-cmd <fmt>         MCU command defining an alias, taking its name
+ *                              and command (e.g. "alias %s '%s'")
+ *      alias <name> <command>  Alias to use for <command> with --aliases
+ *      min-interval <ms> <command>
+ *                              Minimum interval for repeating <command>, as
+ *                              found by --calibrate
+ *
+ *  Settings stored by mcuxeq replace the line with the same key and subject
+ *  (the part of the value after its first word, e.g. the command), keeping
+ *  all other lines.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "mcuxeq.h"
+#include "profile.h"
+
+struct profile_entry {
+	char *key;
+	char *value;
+};
+
+static struct profile_entry *profile_entries;
+static unsigned int profile_nentries;
+
+/*
+ * $<xdg_env>/mcuxeq/<canonical device path, with '/' as '_'><ext>, falling
+ * back to $HOME/<home_dir>/mcuxeq, or /tmp/mcuxeq-<uid>.  If create is set,
+ * missing directories are created.
+ */
+void dev_file_name(char *buf, size_t size, const char *xdg_env,
+		   const char *home_dir, const char *dev, const char *ext,
+		   int create)
+{
+	const char *base = getenv(xdg_env), *p;
+	char canon[PATH_MAX], *q;
+	int n;
+
+	if (base && *base)
+		n = snprintf(buf, size, "%s/mcuxeq", base);
+	else if ((base = getenv("HOME")))
+		n = snprintf(buf, size, "%s/%s/mcuxeq", base, home_dir);
+	else
+		n = snprintf(buf, size, "/tmp/mcuxeq-%u", getuid());
+
+	if (n >= size) {
+		pr_err("Path too long\n");
+		exit(-1);
+	}
+
+	// Create missing directories
+	for (q = buf + 1; create; q++) {
+		if (*q && *q != '/')
+			continue;
+		*q = '\0';
+		if (mkdir(buf, 0755) && errno != EEXIST) {
+			pr_err("Failed to create %s: %s\n", buf,
+			       strerror(errno));
+			exit(-1);
+		}
+		if (q == buf + n)
+			break;
+		*q = '/';
+	}
+
+	p = realpath(dev, canon) ? canon : dev;
+	while (*p == '/')
+		p++;
+	if (snprintf(buf + n, size - n, "/%s%s", p, ext) >= size - n) {
+		pr_err("Path too long\n");
+		exit(-1);
+	}
+
+	for (q = buf + n + 1; *q; q++)
+		if (*q == '/')
+			*q = '_';
+}
+
+static void profile_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < profile_nentries; i++) {
+		free(profile_entries[i].key);
+		free(profile_entries[i].value);
+	}
+	free(profile_entries);
+	profile_entries = NULL;
+	profile_nentries = 0;
+}
+
+void profile_load(const char *dev)
+{
+	char pathname[PATH_MAX], *line = NULL, *value;
+	struct profile_entry *e;
+	unsigned int lineno = 0;
+	size_t size = 0;
+	ssize_t len;
+	FILE *f;
+
+	profile_free();
+	dev_file_name(pathname, sizeof(pathname), "XDG_CONFIG_HOME",
+		      ".config", dev, ".profile", 0);
+
+	// Best effort, the profile only holds optional settings
+	pr_debug("Loading profile %s...\n", pathname);
+	f = fopen(pathname, "r");
+	if (!f) {
+		pr_debug("No profile: %s\n", strerror(errno));
+		return;
+	}
+
+	while ((len = getline(&line, &size, f)) > 0) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0] || line[0] == '#')
+			continue;
+
+		value = line + strcspn(line, " \t");
+		if (!*value) {
+			pr_err("%s:%u: Missing value\n", pathname, lineno);
+			exit(-1);
+		}
+		*value++ = '\0';
+		value += strspn(value, " \t");
+
+		profile_entries = realloc(profile_entries,
+					  (profile_nentries + 1) *
+					  sizeof(*profile_entries));
+		if (!profile_entries) {
+			pr_err("Failed to allocate buffer: %s\n",
+			       strerror(errno));
+			exit(-1);
+		}
+		e = &profile_entries[profile_nentries++];
+		e->key = strdup(line);
+		e->value = strdup(value);
+	}
+
+	free(line);
+	fclose(f);
+}
+
+const char *profile_get(const char *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < profile_nentries; i++)
+		if (!strcmp(profile_entries[i].key, key))
+			return profile_entries[i].value;
+
+	return NULL;
+}
+
+/* The part of a value after its first word, e.g. the command of an alias */
+static const char *profile_subject(const char *value)
+{
+	size_t n = strcspn(value, " \t");
+
+	return value + n + strspn(value + n, " \t");
+}
+
+/* Returns the value of key for cmd (without newline), if any */
+static const char *profile_find(const char *key, const char *cmd, size_t len)
+{
+	const char *subject;
+	unsigned int i;
+
+	for (i = 0; i < profile_nentries; i++) {
+		if (strcmp(profile_entries[i].key, key))
+			continue;
+
+		subject = profile_subject(profile_entries[i].value);
+		if (strlen(subject) == len && !memcmp(subject, cmd, len))
+			return profile_entries[i].value;
+	}
+
+	return NULL;
+}
+
+/* Returns the name of the alias for cmd (without newline), if any */
+const char *profile_alias(const char *cmd, size_t len)
+{
+	static char name[64];
+	const char *value;
+	size_t n;
+
+	value = profile_find("alias", cmd, len);
+	if (!value)
+		return NULL;
+
+	n = strcspn(value, " \t");
+	if (n >= sizeof(name))
+		return NULL;
+
+	memcpy(name, value, n);
+	name[n] = '\0';
+	return name;
+}
+
+/* Returns the minimum interval in ns for cmd (without newline), or zero */
+uint64_t profile_min_interval(const char *cmd, size_t len)
+{
+	const char *value = profile_find("min-interval", cmd, len);
+
+	return value ? strtod(value, NULL) * NSEC_PER_MSEC : 0;
+}
+
+/* Returns non-zero if line sets key for the same subject as value */
+static int profile_match(const char *line, const char *key, const char *value)
+{
+	const char *subject = profile_subject(value);
+	size_t n = strcspn(line, " \t\r\n");
+
+	if (n != strlen(key) || memcmp(line, key, n))
+		return 0;
+
+	line = profile_subject(line + n + strspn(line + n, " \t"));
+	n = strcspn(line, "\r\n");
+
+	return n == strlen(subject) && !memcmp(line, subject, n);
+}
+
+/* Set key to value in the profile of dev, keeping all other lines */
+void profile_store(const char *dev, const char *key, const char *value)
+{
+	char pathname[PATH_MAX], tmp[PATH_MAX], *line = NULL;
+	int replaced = 0;
+	size_t size = 0;
+	FILE *in, *out;
+	ssize_t len;
+
+	dev_file_name(pathname, sizeof(pathname), "XDG_CONFIG_HOME",
+		      ".config", dev, ".profile", 1);
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", pathname) >= sizeof(tmp)) {
+		pr_err("Path too long\n");
+		exit(-1);
+	}
+
+	in = fopen(pathname, "r");
+	if (!in && errno != ENOENT) {
+		pr_err("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		pr_err("Failed to create %s: %s\n", tmp, strerror(errno));
+		exit(-1);
+	}
+
+	while (in && (len = getline(&line, &size, in)) > 0) {
+		if (!profile_match(line, key, value)) {
+			fputs(line, out);
+			if (line[len - 1] != '\n')
+				fputc('\n', out);
+		} else if (!replaced) {
+			fprintf(out, "%s %s\n", key, value);
+			replaced = 1;
+		}
+	}
+	if (!replaced)
+		fprintf(out, "%s %s\n", key, value);
+
+	free(line);
+	if (in)
+		fclose(in);
+	if (fclose(out)) {
+		pr_err("Failed to write %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		exit(-1);
+	}
+
+	// Atomically, for concurrent readers
+	if (rename(tmp, pathname)) {
+		pr_err("Failed to rename %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		exit(-1);
+	}
+
+	profile_load(dev);
+}
@@ -0,0 +1,27 @@
+/*
+ *  Per-device profiles
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern void dev_file_name(char *buf, size_t size, const char *xdg_env,
+			  const char *home_dir, const char *dev,
+			  const char *ext, int create);
+
+extern void profile_load(const char *dev);
+extern const char *profile_get(const char *key);
+extern const char *profile_alias(const char *cmd, size_t len);
+extern uint64_t profile_min_interval(const char *cmd, size_t len);
+extern void profile_store(const char *dev, const char *key,
+			  const char *value);
+
+#endif /* PROFILE_H */
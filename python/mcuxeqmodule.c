@@ -0,0 +1,408 @@
+/*
+ *  Python bindings for persistent sessions
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  A Session runs "mcuxeq --serve", connected through a socket pair, which
+ *  keeps the port open and locked until the session is closed.  The GIL is
+ *  released while waiting for the device, so sessions on different devices
+ *  can be driven from parallel threads.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "serve.h"
+
+#define MCUXEQ_ENV		"MCUXEQ"	/* Path to mcuxeq */
+#define SERVE_FD		3
+
+extern char **environ;
+
+typedef struct {
+	PyObject_HEAD
+	int sock;
+	pid_t pid;
+	PyThread_type_lock lock;
+} SessionObject;
+
+static PyObject *McuxeqError;
+
+/* Returns zero on failure or end of file */
+static int session_read(int sock, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(sock, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/* Returns zero on failure */
+static int session_write(int sock, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt) {
+		n = writev(sock, iov, iovcnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return 0;
+		for (; iovcnt && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Returns the exit status of mcuxeq.  Takes the lock, so the socket is never
+ * closed under a running command.
+ */
+static int session_close_fds(SessionObject *self)
+{
+	int status = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	if (self->lock)
+		PyThread_acquire_lock(self->lock, WAIT_LOCK);
+
+	if (self->sock >= 0) {
+		close(self->sock);
+		self->sock = -1;
+	}
+
+	if (self->pid > 0) {
+		while (waitpid(self->pid, &status, 0) < 0 && errno == EINTR)
+			continue;
+		self->pid = 0;
+	}
+
+	if (self->lock)
+		PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static PyObject *session_fail(SessionObject *self)
+{
+	int status = session_close_fds(self);
+
+	PyErr_Format(McuxeqError, "mcuxeq session ended (status %d)", status);
+	return NULL;
+}
+
+static int Session_init(SessionObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "device", "prompt", "timeout", "debug",
+				  NULL };
+	const char *dev, *prompt = NULL, *prog;
+	char timeout_buf[16], fd_buf[16];
+	posix_spawn_file_actions_t fa;
+	int timeout = -1, debug = 0;
+	const char *argv[16];
+	int sv[2], fd, res;
+	unsigned int i = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|zip", kwlist, &dev,
+					 &prompt, &timeout, &debug))
+		return -1;
+
+	if (self->sock >= 0) {
+		PyErr_SetString(PyExc_ValueError, "Session already open");
+		return -1;
+	}
+
+	prog = getenv(MCUXEQ_ENV);
+	if (!prog || !*prog)
+		prog = "mcuxeq";
+
+	argv[i++] = prog;
+	if (debug)
+		argv[i++] = "-d";
+	argv[i++] = "-s";
+	argv[i++] = dev;
+	if (prompt) {
+		argv[i++] = "-p";
+		argv[i++] = prompt;
+	}
+	if (timeout >= 0) {
+		snprintf(timeout_buf, sizeof(timeout_buf), "%d", timeout);
+		argv[i++] = "-t";
+		argv[i++] = timeout_buf;
+	}
+	snprintf(fd_buf, sizeof(fd_buf), "%d", SERVE_FD);
+	argv[i++] = "--serve";
+	argv[i++] = fd_buf;
+	argv[i] = NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+
+	// dup2() to the same descriptor would keep close-on-exec set
+	fd = sv[1];
+	if (fd == SERVE_FD)
+		fd = fcntl(sv[1], F_DUPFD_CLOEXEC, SERVE_FD + 1);
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fd, SERVE_FD);
+	res = posix_spawnp(&self->pid, prog, &fa, NULL, (char **)argv,
+			   environ);
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (fd != sv[1])
+		close(fd);
+	close(sv[1]);
+
+	if (res) {
+		close(sv[0]);
+		self->pid = 0;
+		errno = res;
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, prog);
+		return -1;
+	}
+
+	self->sock = sv[0];
+	return 0;
+}
+
+static PyObject *Session_new(PyTypeObject *type, PyObject *args,
+			     PyObject *kwds)
+{
+	SessionObject *self;
+
+	self = (SessionObject *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	self->sock = -1;
+	self->lock = PyThread_allocate_lock();
+	if (!self->lock) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+
+	return (PyObject *)self;
+}
+
+static void Session_dealloc(SessionObject *self)
+{
+	session_close_fds(self);
+	if (self->lock)
+		PyThread_free_lock(self->lock);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Split into memoryviews of the response, sharing its buffer */
+static PyObject *session_lines(PyObject *resp)
+{
+	const char *buf = PyBytes_AS_STRING(resp), *nl;
+	Py_ssize_t len = PyBytes_GET_SIZE(resp), pos = 0;
+	PyObject *view, *list, *line;
+
+	view = PyMemoryView_FromObject(resp);
+	list = PyList_New(0);
+	if (!view || !list)
+		goto fail;
+
+	while (pos < len) {
+		nl = memchr(buf + pos, '\n', len - pos);
+		line = PySequence_GetSlice(view, pos, nl ? nl - buf : len);
+		if (!line || PyList_Append(list, line)) {
+			Py_XDECREF(line);
+			goto fail;
+		}
+		Py_DECREF(line);
+		pos = nl ? nl - buf + 1 : len;
+	}
+
+	Py_DECREF(view);
+	Py_DECREF(resp);
+	return list;
+
+fail:
+	Py_XDECREF(list);
+	Py_XDECREF(view);
+	Py_DECREF(resp);
+	return NULL;
+}
+
+static PyObject *Session_exec(SessionObject *self, PyObject *args,
+			      PyObject *kwds)
+{
+	static char *kwlist[] = { "command", "lines", NULL };
+	struct serve_hdr hdr;
+	struct iovec iov[2];
+	PyObject *resp;
+	Py_buffer cmd;
+	int lines = 0, alive, ok;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*|p", kwlist, &cmd,
+					 &lines))
+		return NULL;
+
+	if (self->sock < 0) {
+		PyBuffer_Release(&cmd);
+		PyErr_SetString(PyExc_ValueError, "Session is closed");
+		return NULL;
+	}
+
+	hdr.len = cmd.len;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = cmd.buf;
+	iov[1].iov_len = cmd.len;
+
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	// Another thread may have closed the session meanwhile
+	alive = self->sock >= 0;
+	ok = alive && session_write(self->sock, iov, 2) &&
+	     session_read(self->sock, &hdr, sizeof(hdr));
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&cmd);
+
+	if (!alive) {
+		PyThread_release_lock(self->lock);
+		PyErr_SetString(PyExc_ValueError, "Session is closed");
+		return NULL;
+	}
+	if (!ok) {
+		PyThread_release_lock(self->lock);
+		return session_fail(self);
+	}
+
+	// Receive directly into the bytes object
+	resp = PyBytes_FromStringAndSize(NULL, hdr.len);
+	if (!resp) {
+		// Out of sync with the response
+		PyThread_release_lock(self->lock);
+		session_close_fds(self);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = session_read(self->sock, PyBytes_AS_STRING(resp), hdr.len);
+	PyThread_release_lock(self->lock);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		Py_DECREF(resp);
+		return session_fail(self);
+	}
+
+	return lines ? session_lines(resp) : resp;
+}
+
+static PyObject *Session_close(SessionObject *self, PyObject *unused)
+{
+	int status;
+
+	// Closing a closed session is a no-op, with status 0
+	status = session_close_fds(self);
+	if (status) {
+		PyErr_Format(McuxeqError, "mcuxeq session ended (status %d)",
+			     status);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Session_enter(SessionObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+static PyObject *Session_exit(SessionObject *self, PyObject *args)
+{
+	return Session_close(self, NULL);
+}
+
+static PyMethodDef Session_methods[] = {
+	{ "exec", (PyCFunction)(void (*)(void))Session_exec,
+	  METH_VARARGS | METH_KEYWORDS,
+	  "exec(command, lines=False)\n--\n\n"
+	  "Execute a command, and return its response as bytes, or as a list\n"
+	  "of memoryviews of its lines if lines is true." },
+	{ "close", (PyCFunction)Session_close, METH_NOARGS,
+	  "Close the session, and release the device." },
+	{ "__enter__", (PyCFunction)Session_enter, METH_NOARGS, NULL },
+	{ "__exit__", (PyCFunction)Session_exit, METH_VARARGS, NULL },
+	{ NULL },
+};
+
+static PyTypeObject SessionType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "mcuxeq.Session",
+	.tp_doc = "Session(device, prompt=None, timeout=-1, debug=False)\n--\n\n"
+		  "Persistent session with a device, keeping it open and locked.",
+	.tp_basicsize = sizeof(SessionObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = Session_new,
+	.tp_init = (initproc)Session_init,
+	.tp_dealloc = (destructor)Session_dealloc,
+	.tp_methods = Session_methods,
+};
+
+static struct PyModuleDef mcuxeq_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "mcuxeq",
+	.m_doc = "Microcontroller Command/Response Utility sessions",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_mcuxeq(void)
+{
+	PyObject *m;
+
+	if (PyType_Ready(&SessionType) < 0)
+		return NULL;
+
+	m = PyModule_Create(&mcuxeq_module);
+	if (!m)
+		return NULL;
+
+	McuxeqError = PyErr_NewException("mcuxeq.Error", PyExc_RuntimeError,
+					 NULL);
+	Py_INCREF(&SessionType);
+	if (!McuxeqError ||
+	    PyModule_AddObject(m, "Session", (PyObject *)&SessionType) ||
+	    PyModule_AddObject(m, "Error", McuxeqError)) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	return m;
+}
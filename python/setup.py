@@ -0,0 +1,26 @@
+#
+# Python bindings for persistent mcuxeq sessions
+#
+# Usage: pip install ./python
+#
+
+import os
+
+from setuptools import Extension, setup
+
+top = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+
+setup(
+    name="mcuxeq",
+    version="1.0",
+    description="Persistent sessions with microcontroller shells",
+    license="GPL",
+    ext_modules=[
+        Extension(
+            "mcuxeq",
+            sources=["mcuxeqmodule.c"],
+            include_dirs=[top],
+            extra_compile_args=["-Wall"],
+        ),
+    ],
+)
@@ -0,0 +1,121 @@
+/*
+ *  Persistent sessions for language bindings
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  Keeps the port open and locked, and executes commands received on a
+ *  socket, avoiding the cost of starting mcuxeq and setting up the port for
+ *  each command.  Each request and response consists of a struct serve_hdr,
+ *  followed by the data.  Errors terminate the session, which the client
+ *  sees as end of file.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include "mcuxeq.h"
+#include "serve.h"
+
+#define SERVE_MAX_CMD		65536
+
+/* Returns zero on end of file */
+static int serve_read(int sock, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(sock, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			pr_err("Read error: %s\n", strerror(errno));
+			exit(-1);
+		}
+		if (!n)
+			return 0;
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static void serve_write(int sock, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt) {
+		n = writev(sock, iov, iovcnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			pr_err("Write error: %s\n", strerror(errno));
+			exit(-1);
+		}
+		for (; iovcnt && n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+int serve_run(const char *dev, int sock)
+{
+	struct serve_hdr hdr;
+	struct iovec iov[2];
+	char *cmd, *buf;
+	size_t size;
+	FILE *out;
+	int fd;
+
+	cmd = malloc(SERVE_MAX_CMD + 1);
+	if (!cmd) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	fd = mcu_open(dev);
+
+	while (serve_read(sock, &hdr, sizeof(hdr))) {
+		if (hdr.len > SERVE_MAX_CMD) {
+			pr_err("Command too long\n");
+			exit(-1);
+		}
+		if (!serve_read(sock, cmd, hdr.len))
+			break;
+		if (!hdr.len || cmd[hdr.len - 1] != '\n')
+			cmd[hdr.len++] = '\n';
+
+		out = open_memstream(&buf, &size);
+		if (!out) {
+			pr_err("Failed to allocate buffer: %s\n",
+			       strerror(errno));
+			exit(-1);
+		}
+		mcu_cmd(fd, cmd, hdr.len, out);
+		fclose(out);
+
+		hdr.len = size;
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = buf;
+		iov[1].iov_len = size;
+		serve_write(sock, iov, 2);
+		free(buf);
+	}
+
+	mcu_close(fd);
+	free(cmd);
+
+	return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ *  Persistent sessions for language bindings
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+
+/*
+ * Requests and responses are prefixed by their length, in host byte order,
+ * as both ends run on the same host
+ */
+struct serve_hdr {
+	uint64_t len;
+};
+
+extern int serve_run(const char *dev, int sock);
+
+#endif /* SERVE_H */
@@ -0,0 +1,81 @@
+#!/bin/bash
+#
+# Inject each class of faults supported by the MCU shell simulator, and
+# measure how mcuxeq copes, in milliseconds:
+#   - DETECT: time until mcuxeq failed on the command hit by the fault,
+#   - RECOVER: time from the start of that command until a following command
+#     succeeded with the expected response.
+# Faults that did not make mcuxeq fail, but corrupted its output, are counted
+# as UNDETECTED.
+#
+# Usage: sim/faults.sh [<mcuxeq>]
+#
+
+MCUXEQ=${1:-./mcuxeq}
+MCUSIM=${MCUSIM:-sim/mcusim}
+FAULTS=${FAULTS:-drop-echo garble-echo stall spurious-prompt reset hangup}
+ROUNDS=${ROUNDS:-5}		# Faults injected per class
+EVERY=5				# Inject a fault into every 5th command
+STALL=3000			# Longer than mcuxeq's default timeout
+
+# Don't pollute /dev/shm with statistics for temporary devices
+export MCUXEQ_STATS=
+
+now_us() {
+	echo $((${EPOCHREALTIME/./}))
+}
+
+bench() {
+	local fault=$1 dev sim ref out status cmd=1 start end
+	local detected=0 undetected=0 detect=0 recover=0 round
+
+	dev=$(mktemp -u /tmp/mcusim.XXXXXX)
+	"$MCUSIM" -l "$dev" -f "$fault" -e $EVERY -s $STALL > /dev/null &
+	sim=$!
+	while [ ! -e "$dev" ]; do
+		sleep 0.01
+	done
+
+	ref=$("$MCUXEQ" -s "$dev" sample all) || exit 1
+	cmd=2
+
+	for ((round = 0; round < ROUNDS; round++)); do
+		# Skip to the command hit by the next fault
+		for (( ; cmd % EVERY; cmd++)); do
+			"$MCUXEQ" -s "$dev" sample all > /dev/null 2>&1
+		done
+
+		start=$(now_us)
+		out=$("$MCUXEQ" -s "$dev" sample all 2> /dev/null)
+		status=$?
+		end=$(now_us)
+		cmd=$((cmd + 1))
+
+		if [ $status -ne 0 ]; then
+			detected=$((detected + 1))
+			detect=$((detect + end - start))
+		elif [ "$out" != "$ref" ]; then
+			undetected=$((undetected + 1))
+		fi
+
+		while [ "$out" != "$ref" ]; do
+			out=$("$MCUXEQ" -s "$dev" sample all 2> /dev/null)
+			end=$(now_us)
+			cmd=$((cmd + 1))
+		done
+		recover=$((recover + end - start))
+	done
+
+	kill $sim
+	wait $sim 2> /dev/null
+
+	echo "$fault $detected $undetected $detect $recover $ROUNDS" | awk '{
+		printf "%-16s %8u %10u %10s %10.1f\n", $1, $2, $3,
+		       $2 ? sprintf("%.1f", $4 / $2 / 1000) : "-",
+		       $5 / $6 / 1000 }'
+}
+
+printf "%-16s %8s %10s %10s %10s\n" FAULT DETECTED UNDETECTED DETECT RECOVER
+for fault in $FAULTS; do
+	bench $fault
+done
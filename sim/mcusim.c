@@ -0,0 +1,710 @@
+/*
+ *  Microcontroller Shell Simulator
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  Provides a pseudo-terminal behaving like a simple MCU shell: input is
+ *  echoed, and a prompt is printed after each command's response.  Used for
+ *  testing and benchmarking mcuxeq without hardware.
+ *
+ *  Faults can be injected into every n-th command, to test recovery:
+ *
+ *      drop-echo               The command is not echoed
+ *      garble-echo             The first character of the echo is corrupted
+ *      stall                   The response is delayed
+ *      spurious-prompt         A prompt is printed before the response
+ *      reset                   The MCU resets in the middle of the response
+ *      hangup                  The terminal is hung up, and recreated
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PROMPT		"> "
+#define DEFAULT_EVERY		10
+#define DEFAULT_STALL_MS	5000
+#define RATE_BURST		4	/* Commands handled without delay */
+
+#define CMD_SIZE		256
+#define OUT_SIZE		4096
+#define MAX_POKES		256
+#define MAX_SETTINGS		4096
+#define MAX_ALIASES		32
+
+#define pr_err(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+
+static const char *opt_link;
+static const char *opt_prompt = DEFAULT_PROMPT;
+static int opt_delay;
+static const char *opt_fault;
+static unsigned int opt_every = DEFAULT_EVERY;
+static int opt_stall = DEFAULT_STALL_MS;
+static unsigned int opt_rate;
+
+enum fault {
+	FAULT_NONE,
+	FAULT_DROP_ECHO,
+	FAULT_GARBLE_ECHO,
+	FAULT_STALL,
+	FAULT_SPURIOUS_PROMPT,
+	FAULT_RESET,
+	FAULT_HANGUP,
+};
+
+static const char * const fault_names[] = {
+	[FAULT_DROP_ECHO] = "drop-echo",
+	[FAULT_GARBLE_ECHO] = "garble-echo",
+	[FAULT_STALL] = "stall",
+	[FAULT_SPURIOUS_PROMPT] = "spurious-prompt",
+	[FAULT_RESET] = "reset",
+	[FAULT_HANGUP] = "hangup",
+};
+
+static enum fault sim_fault;
+static unsigned long sim_ncmds;
+
+static struct {
+	uint32_t addr;
+	uint8_t val;
+} mem_pokes[MAX_POKES];
+static unsigned int mem_npokes;
+
+static struct {
+	char *key;
+	char *val;
+} settings[MAX_SETTINGS];
+static unsigned int nsettings;
+
+static struct {
+	char *name;
+	char *cmd;
+} aliases[MAX_ALIASES];
+static unsigned int naliases;
+
+static struct timespec sim_start;
+static int sim_fd;
+static char sim_out[OUT_SIZE];
+static size_t sim_outlen;
+
+static void __attribute__ ((noreturn)) usage(void)
+{
+	fprintf(stderr,
+		"\n"
+		"%s: [options]\n\n"
+		"Valid options are:\n"
+		"    -h, --help              Display this usage information\n"
+		"    -l, --link <path>       Create a symlink to the terminal\n"
+		"    -p, --prompt <prompt>   Prompt to print (Default: \"%s\")\n"
+		"    -d, --delay <ms>        Response delay in milliseconds\n"
+		"                            (Default: 0)\n"
+		"    -f, --fault <fault>     Inject a fault (drop-echo, garble-echo,\n"
+		"                            stall, spurious-prompt, reset, hangup)\n"
+		"    -e, --every <n>         Inject the fault into every n-th command\n"
+		"                            (Default: %u)\n"
+		"    -s, --stall <ms>        Duration of a stall (Default: %u)\n"
+		"    -r, --rate <n>          Maximum sustained commands per second,\n"
+		"                            faster commands are delayed\n"
+		"\n"
+		"Commands:\n"
+		"    echo <text>             Print <text>\n"
+		"    sample [all]            Print power measurements\n"
+		"    raw <hex> ...           Print the given bytes\n"
+		"    uptime                  Print the time since startup\n"
+		"    dump <addr> <len>       Hex dump of simulated memory, until\n"
+		"                            CTRL-C is received\n"
+		"    crc <addr> <len>        CRC-32 of simulated memory\n"
+		"    poke <addr> <val>       Modify a byte of simulated memory\n"
+		"    set <key> <value>       Change a setting\n"
+		"    cfgsum                  Print a checksum of all settings\n"
+		"    regs <n>                Print <n> register lines\n"
+		"    alias <name> <command>  Define an alias\n"
+		"    stream <ms> [<n>]       Print a sample every <ms> until CTRL-C\n"
+		"                            is received, or <n> samples\n"
+		"    help                    List commands\n"
+		"\n",
+		program_invocation_short_name, DEFAULT_PROMPT, DEFAULT_EVERY,
+		DEFAULT_STALL_MS);
+	exit(1);
+}
+
+static void write_all(const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(sim_fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("Write error: %s\n", strerror(errno));
+			exit(-1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void sim_flush(void)
+{
+	write_all(sim_out, sim_outlen);
+	sim_outlen = 0;
+}
+
+static void sim_write(const char *buf, size_t len)
+{
+	if (sim_outlen + len > sizeof(sim_out))
+		sim_flush();
+
+	if (len > sizeof(sim_out)) {
+		write_all(buf, len);
+		return;
+	}
+
+	memcpy(sim_out + sim_outlen, buf, len);
+	sim_outlen += len;
+}
+
+static void __attribute__ ((format (printf, 1, 2))) sim_printf(const char *fmt,
+								...)
+{
+	char buf[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	sim_write(buf, n < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+
+/* Check for CTRL-C, waiting up to ms */
+static int sim_interrupted(int ms)
+{
+	struct pollfd pfd = { .fd = sim_fd, .events = POLLIN };
+	char c;
+
+	if (poll(&pfd, 1, ms) <= 0 || read(sim_fd, &c, 1) != 1 || c != 0x03)
+		return 0;
+
+	sim_printf("^C\r\n");
+	return 1;
+}
+
+/* Simulated memory, with a deterministic pattern, and modified bytes */
+static uint8_t mem_byte(uint32_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < mem_npokes; i++)
+		if (mem_pokes[i].addr == addr)
+			return mem_pokes[i].val;
+
+	return (addr * 2654435761U) >> 24;
+}
+
+static void cmd_echo(char *args)
+{
+	sim_printf("%s\r\n", args);
+}
+
+static void cmd_raw(char *args)
+{
+	char *end;
+	char c;
+
+	while (1) {
+		c = strtoul(args, &end, 16);
+		if (end == args)
+			break;
+		sim_write(&c, 1);
+		args = end;
+	}
+	sim_printf("\r\n");
+}
+
+static void cmd_sample(char *args)
+{
+	sim_printf("1.000 V / 0.100 A / 0.100 W\r\n"
+		   "2.000 V / 0.200 A / 0.400 W\r\n");
+}
+
+static void cmd_uptime(char *args)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	sim_printf("%lu ms\r\n", (unsigned long)((ts.tv_sec - sim_start.tv_sec) *
+		   1000 + (ts.tv_nsec - sim_start.tv_nsec) / 1000000));
+}
+
+static void cmd_dump(char *args)
+{
+	unsigned long addr, len, i;
+	char *end;
+
+	addr = strtoul(args, &end, 0);
+	len = strtoul(end, NULL, 0);
+	for (i = 0; i < len; i++) {
+		if (!(i % 16)) {
+			if (i) {
+				sim_printf("\r\n");
+				if (sim_interrupted(0))
+					return;
+			}
+			sim_printf("%08lx:", addr + i);
+		}
+		sim_printf(" %02x", mem_byte(addr + i));
+	}
+	if (len)
+		sim_printf("\r\n");
+}
+
+static uint32_t crc32_byte(uint32_t crc, uint8_t c)
+{
+	unsigned int j;
+
+	crc ^= c;
+	for (j = 0; j < 8; j++)
+		crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+
+	return crc;
+}
+
+static void cmd_crc(char *args)
+{
+	unsigned long addr, len, i;
+	uint32_t crc = 0xffffffff;
+	char *end;
+
+	addr = strtoul(args, &end, 0);
+	len = strtoul(end, NULL, 0);
+	for (i = 0; i < len; i++)
+		crc = crc32_byte(crc, mem_byte(addr + i));
+	sim_printf("%08x\r\n", crc ^ 0xffffffff);
+}
+
+static void cmd_set(char *args)
+{
+	size_t n = strcspn(args, " ");
+	unsigned int i;
+
+	if (!n || !args[n]) {
+		sim_printf("Usage: set <key> <value>\r\n");
+		return;
+	}
+	args[n++] = '\0';
+
+	for (i = 0; i < nsettings; i++)
+		if (!strcmp(settings[i].key, args))
+			break;
+	if (i == MAX_SETTINGS) {
+		sim_printf("Too many settings\r\n");
+		return;
+	}
+	if (i == nsettings) {
+		settings[nsettings++].key = strdup(args);
+	} else {
+		free(settings[i].val);
+	}
+	settings[i].val = strdup(args + n);
+}
+
+/* Order-independent checksum of all settings */
+static void cmd_cfgsum(char *args)
+{
+	uint32_t crc, sum = 0;
+	unsigned int i;
+	const char *p;
+
+	for (i = 0; i < nsettings; i++) {
+		crc = 0xffffffff;
+		for (p = settings[i].key; *p; p++)
+			crc = crc32_byte(crc, *p);
+		crc = crc32_byte(crc, '=');
+		for (p = settings[i].val; *p; p++)
+			crc = crc32_byte(crc, *p);
+		sum += crc ^ 0xffffffff;
+	}
+	sim_printf("%u settings, sum %08x\r\n", nsettings, sum);
+}
+
+static void cmd_poke(char *args)
+{
+	unsigned long addr, val;
+	unsigned int i;
+	char *end;
+
+	addr = strtoul(args, &end, 0);
+	val = strtoul(end, NULL, 0);
+	for (i = 0; i < mem_npokes; i++)
+		if (mem_pokes[i].addr == addr)
+			break;
+	if (i == MAX_POKES) {
+		sim_printf("Too many modifications\r\n");
+		return;
+	}
+	if (i == mem_npokes)
+		mem_npokes++;
+	mem_pokes[i].addr = addr;
+	mem_pokes[i].val = val;
+}
+
+static void cmd_regs(char *args)
+{
+	unsigned long i, n = strtoul(args, NULL, 0);
+
+	for (i = 0; i < n; i++)
+		sim_printf("r%lu -> 0x%08x\r\n", i % 32,
+			   mem_byte(i) * 0x01010101U);
+}
+
+static void cmd_alias(char *args)
+{
+	size_t n = strcspn(args, " ");
+	unsigned int i;
+
+	if (!n || !args[n]) {
+		for (i = 0; i < naliases; i++)
+			sim_printf("%s = %s\r\n", aliases[i].name,
+				   aliases[i].cmd);
+		return;
+	}
+	args[n++] = '\0';
+
+	for (i = 0; i < naliases; i++)
+		if (!strcmp(aliases[i].name, args))
+			break;
+	if (i == MAX_ALIASES) {
+		sim_printf("Too many aliases\r\n");
+		return;
+	}
+	if (i == naliases) {
+		aliases[naliases++].name = strdup(args);
+	} else {
+		free(aliases[i].cmd);
+	}
+	aliases[i].cmd = strdup(args + n + strspn(args + n, " "));
+}
+
+/* Print a sample every <ms> until CTRL-C is received, or <n> samples */
+static void cmd_stream(char *args)
+{
+	unsigned long ms, n, i;
+	char *end;
+
+	ms = strtoul(args, &end, 0);
+	n = strtoul(end, NULL, 0);
+	for (i = 0; !n || i < n; i++) {
+		sim_printf("%lu: %lu.%03lu V\r\n", i, i % 5, i * 7 % 1000);
+		sim_flush();
+		if (sim_interrupted(ms))
+			return;
+	}
+}
+
+static void cmd_help(char *args);
+
+static const struct sim_cmd {
+	const char *name;
+	void (*fn)(char *args);
+} sim_cmds[] = {
+	{ "echo", cmd_echo },
+	{ "sample", cmd_sample },
+	{ "raw", cmd_raw },
+	{ "uptime", cmd_uptime },
+	{ "dump", cmd_dump },
+	{ "crc", cmd_crc },
+	{ "poke", cmd_poke },
+	{ "set", cmd_set },
+	{ "cfgsum", cmd_cfgsum },
+	{ "regs", cmd_regs },
+	{ "alias", cmd_alias },
+	{ "stream", cmd_stream },
+	{ "help", cmd_help },
+};
+
+static void cmd_help(char *args)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sim_cmds) / sizeof(*sim_cmds); i++)
+		sim_printf("%s\r\n", sim_cmds[i].name);
+}
+
+static void sim_exec(char *line)
+{
+	unsigned int i;
+	size_t n;
+
+	n = strcspn(line, " ");
+	if (!n)
+		return;
+
+	for (i = 0; i < naliases; i++) {
+		if (!strcmp(line, aliases[i].name)) {
+			line = strdupa(aliases[i].cmd);
+			n = strcspn(line, " ");
+			break;
+		}
+	}
+
+	for (i = 0; i < sizeof(sim_cmds) / sizeof(*sim_cmds); i++) {
+		if (strlen(sim_cmds[i].name) == n &&
+		    !strncmp(line, sim_cmds[i].name, n)) {
+			sim_cmds[i].fn(line + n + strspn(line + n, " "));
+			return;
+		}
+	}
+
+	sim_printf("Unknown command '%s'\r\n", line);
+}
+
+static void sim_exit(int sig)
+{
+	if (opt_link)
+		unlink(opt_link);
+	_exit(0);
+}
+
+/* Create the pseudo-terminal, keeping the slave open */
+static int sim_open(void)
+{
+	struct termios termios;
+	const char *name;
+	int slave;
+
+	sim_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (sim_fd < 0 || grantpt(sim_fd) || unlockpt(sim_fd) ||
+	    !(name = ptsname(sim_fd))) {
+		pr_err("Failed to create pseudo-terminal: %s\n",
+		       strerror(errno));
+		exit(-1);
+	}
+
+	// Keep the slave open, so the master survives clients closing it
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &termios)) {
+		pr_err("Failed to open %s: %s\n", name, strerror(errno));
+		exit(-1);
+	}
+	cfmakeraw(&termios);
+	tcsetattr(slave, TCSANOW, &termios);
+
+	if (opt_link) {
+		unlink(opt_link);
+		if (symlink(name, opt_link)) {
+			pr_err("Failed to create %s: %s\n", opt_link,
+			       strerror(errno));
+			exit(-1);
+		}
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	return slave;
+}
+
+/* Execute a command, with the configured fault injected */
+static void sim_exec_fault(char *line, int *slave)
+{
+	static const char reset[] = "\r\n\r\nMCU reset\r\n";
+
+	switch (sim_fault) {
+	case FAULT_STALL:
+		sim_flush();
+		usleep(opt_stall * 1000);
+		break;
+
+	case FAULT_SPURIOUS_PROMPT:
+		sim_write(opt_prompt, strlen(opt_prompt));
+		break;
+
+	case FAULT_RESET:
+		// Only the start of the response makes it out
+		sim_exec(line);
+		sim_outlen = sim_outlen > 8 ? 8 : sim_outlen;
+		sim_write(reset, strlen(reset));
+		return;
+
+	case FAULT_HANGUP:
+		sim_outlen = 0;
+		close(sim_fd);
+		close(*slave);
+		*slave = sim_open();
+		return;
+
+	default:
+		break;
+	}
+
+	sim_exec(line);
+}
+
+/*
+ * Limit the sustained command rate using a token bucket, as if commands
+ * arriving too fast starve a background task, which catches up first
+ */
+static void sim_throttle(void)
+{
+	static double tokens = RATE_BURST;
+	static struct timespec last;
+	struct timespec now;
+	double wait;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (last.tv_sec)
+		tokens += (now.tv_sec - last.tv_sec +
+			   (now.tv_nsec - last.tv_nsec) / 1e9) * opt_rate;
+	if (tokens > RATE_BURST)
+		tokens = RATE_BURST;
+
+	if (tokens < 1) {
+		wait = (1 - tokens) / opt_rate;
+		usleep(wait * 1e6);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		tokens = 1;
+	}
+
+	tokens -= 1;
+	last = now;
+}
+
+static enum fault parse_fault(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(fault_names) / sizeof(*fault_names); i++)
+		if (fault_names[i] && !strcmp(fault_names[i], name))
+			return i;
+
+	pr_err("Unknown fault %s\n", name);
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[256], line[CMD_SIZE], c;
+	enum fault fault = FAULT_NONE;
+	size_t linelen = 0;
+	int slave;
+	ssize_t n;
+	int i;
+
+	while (argc > 1) {
+		if (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+			usage();
+		} else if (argc > 2) {
+			if (!strcmp(argv[1], "-l") ||
+			    !strcmp(argv[1], "--link")) {
+				opt_link = argv[2];
+			} else if (!strcmp(argv[1], "-p") ||
+				   !strcmp(argv[1], "--prompt")) {
+				opt_prompt = argv[2];
+			} else if (!strcmp(argv[1], "-d") ||
+				   !strcmp(argv[1], "--delay")) {
+				opt_delay = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "-f") ||
+				   !strcmp(argv[1], "--fault")) {
+				opt_fault = argv[2];
+			} else if (!strcmp(argv[1], "-e") ||
+				   !strcmp(argv[1], "--every")) {
+				opt_every = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "-s") ||
+				   !strcmp(argv[1], "--stall")) {
+				opt_stall = atoi(argv[2]);
+			} else if (!strcmp(argv[1], "-r") ||
+				   !strcmp(argv[1], "--rate")) {
+				opt_rate = atoi(argv[2]);
+			} else {
+				usage();
+			}
+			argv++;
+			argc--;
+		} else {
+			usage();
+		}
+		argv++;
+		argc--;
+	}
+
+	if (opt_fault)
+		fault = parse_fault(opt_fault);
+	if (!opt_every)
+		opt_every = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &sim_start);
+	slave = sim_open();
+
+	signal(SIGINT, sim_exit);
+	signal(SIGTERM, sim_exit);
+
+	while (1) {
+		n = read(sim_fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("Read error: %s\n", strerror(errno));
+			exit(-1);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!linelen)
+				sim_fault = (sim_ncmds + 1) % opt_every ?
+					    FAULT_NONE : fault;
+
+			if (buf[i] == 0x03) {
+				// CTRL-C discards the current line
+				linelen = 0;
+				sim_write("^C\r\n", 4);
+				sim_write(opt_prompt, strlen(opt_prompt));
+				continue;
+			}
+
+			if (buf[i] != '\r' && buf[i] != '\n') {
+				c = buf[i];
+				if (sim_fault == FAULT_GARBLE_ECHO && !linelen)
+					c ^= 0x20;
+				if (linelen < sizeof(line) - 1)
+					line[linelen++] = buf[i];
+				if (sim_fault != FAULT_DROP_ECHO)
+					sim_write(&c, 1);
+				continue;
+			}
+
+			sim_write("\r\n", 2);
+			sim_flush();
+			line[linelen] = '\0';
+			linelen = 0;
+			sim_ncmds++;
+
+			if (opt_delay)
+				usleep(opt_delay * 1000);
+			if (opt_rate)
+				sim_throttle();
+			sim_exec_fault(line, &slave);
+			if (sim_fault == FAULT_HANGUP)
+				break;
+			sim_write(opt_prompt, strlen(opt_prompt));
+		}
+		sim_flush();
+	}
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Run a representative workload against the MCU shell simulator, and print
+# the CPU time (user + system) spent by mcuxeq for each part, in seconds
+#
+# Usage: sim/workload.sh [<mcuxeq>]
+#
+
+MCUXEQ=${1:-./mcuxeq}
+MCUSIM=${MCUSIM:-sim/mcusim}
+
+dev=$(mktemp -u /tmp/mcusim.XXXXXX)
+"$MCUSIM" -l "$dev" > /dev/null &
+sim=$!
+trap 'kill $sim' EXIT
+while [ ! -e "$dev" ]; do
+	sleep 0.01
+done
+
+# Don't pollute /dev/shm with statistics for temporary devices
+export MCUXEQ_STATS=
+export MCUXEQ_DEV=$dev
+
+run() {
+	local name=$1 t
+
+	shift
+	t=$( { TIMEFORMAT='%U %S'; time "$MCUXEQ" "$@" > /dev/null; } 2>&1 ) ||
+		exit 1
+	echo "$name $t" | awk '{ printf "%-12s %8.3f\n", $1, $2 + $3 }'
+}
+
+run small	-n 50000 echo x			# Many small commands
+run long	-n 20 dump 0 65536		# Long responses
+run prompt	-n 50 regs 2000			# Lines with prompt characters
@@ -0,0 +1,363 @@
+/*
+ *  Shared per-device statistics
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mcuxeq.h"
+#include "stats.h"
+
+static struct stats *stats;
+static int stats_waiter = -1;
+static int stats_busy;
+static int stats_cmd;
+static int stats_disabled;
+
+const char *stats_dir(void)
+{
+	const char *dir = getenv(MCUXEQ_STATS_ENV);
+
+	return dir ? dir : DEFAULT_STATS_DIR;
+}
+
+static const char *stats_canon(char *buf, const char *dev)
+{
+	return realpath(dev, buf) ? buf : dev;
+}
+
+int stats_name(char *buf, size_t size, const char *dev)
+{
+	char canon[PATH_MAX];
+	const char *p;
+	int n;
+
+	p = stats_canon(canon, dev);
+	while (*p == '/')
+		p++;
+
+	n = snprintf(buf, size, "%s/" STATS_PREFIX "%s", stats_dir(), p);
+	if (n < 0 || n >= size)
+		return -1;
+
+	for (buf += strlen(stats_dir()) + 1; *buf; buf++)
+		if (*buf == '/')
+			*buf = '_';
+
+	return 0;
+}
+
+int stats_valid(const struct stats *s)
+{
+	return __atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) == STATS_MAGIC &&
+	       s->version == STATS_VERSION;
+}
+
+int stats_pid_alive(pid_t pid)
+{
+	return pid > 0 && (!kill(pid, 0) || errno == EPERM);
+}
+
+void stats_read(const struct stats *s, struct stats_snapshot *snap)
+{
+	unsigned int tries;
+	uint32_t seq;
+
+	// Bounded, as a writer may have been killed in the middle of an update
+	for (tries = 0; tries < 1000; tries++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		snap->owner = s->owner;
+		snap->busy_since = s->busy_since;
+		snap->busy_ns = s->busy_ns;
+		memcpy(snap->cmd, s->cmd, sizeof(snap->cmd));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(seq & 1) &&
+		    __atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	snap->cmd[sizeof(snap->cmd) - 1] = '\0';
+	if (!stats_pid_alive(snap->owner))
+		snap->owner = 0;
+}
+
+unsigned int stats_queue_depth(const struct stats *s)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < STATS_WAITERS; i++)
+		if (stats_pid_alive(__atomic_load_n(&s->waiters[i],
+						    __ATOMIC_RELAXED)))
+			n++;
+
+	return n;
+}
+
+static void stats_exit(void)
+{
+	// Anything still pending at exit time failed
+	stats_wait_end();
+
+	if (stats_cmd)
+		__atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+	stats_busy_end();
+}
+
+/*
+ * Statistics are best effort: failure to set up the shared segment must
+ * never prevent a command from being executed.
+ */
+struct stats *stats_map(const char *dev)
+{
+	char path[PATH_MAX], canon[PATH_MAX];
+	int fd, retry = 1;
+	struct stat st;
+	uint32_t magic;
+	struct stats *s;
+
+	if (!*stats_dir())
+		return NULL;
+
+	if (stats_name(path, sizeof(path), dev)) {
+		pr_debug("Statistics path too long\n");
+		return NULL;
+	}
+
+again:
+	magic = 0;
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		pr_debug("Failed to open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	// Other users could declare the port dead, or corrupt the counters
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid()) {
+		pr_debug("Ignoring statistics in %s, not owned by us\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	if ((st.st_mode & 077) || (st.st_size && st.st_size != sizeof(*s))) {
+		// Others may still have it mapped, so replace it
+		close(fd);
+		if (retry-- && !unlink(path))
+			goto again;
+
+		pr_debug("Ignoring statistics in %s, not private\n", path);
+		return NULL;
+	}
+
+	if (ftruncate(fd, sizeof(*s))) {
+		pr_debug("Failed to size %s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		pr_debug("Failed to map %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (!__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE)) {
+		s->version = STATS_VERSION;
+		snprintf(s->dev, sizeof(s->dev), "%s", stats_canon(canon, dev));
+		__atomic_compare_exchange_n(&s->magic, &magic, STATS_MAGIC, 0,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+
+	if (!stats_valid(s)) {
+		// Replace a segment left behind by an older version
+		munmap(s, sizeof(*s));
+		if (retry-- && !unlink(path))
+			goto again;
+
+		pr_debug("Ignoring incompatible statistics in %s\n", path);
+		return NULL;
+	}
+
+	return s;
+}
+
+void stats_open(const char *dev)
+{
+	if (stats || stats_disabled)
+		return;
+
+	stats = stats_map(dev);
+	if (stats)
+		atexit(stats_exit);
+}
+
+/* Don't account the commands of this process, e.g. keepalive probes */
+void stats_disable(void)
+{
+	stats_disabled = 1;
+}
+
+void stats_set_health(struct stats *s, enum stats_health health)
+{
+	__atomic_store_n(&s->health_pid, getpid(), __ATOMIC_RELAXED);
+	__atomic_store_n(&s->health_time, get_time_ns(), __ATOMIC_RELAXED);
+	__atomic_store_n(&s->health, health, __ATOMIC_RELEASE);
+}
+
+/* Segments are private, so only processes of the same user publish health */
+static int stats_pid_ours(pid_t pid)
+{
+	char path[32];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/proc/%d", pid);
+	return !stat(path, &st) && st.st_uid == geteuid();
+}
+
+/* Returns the health of the port, as long as its keepalive process runs */
+enum stats_health stats_health(const struct stats *s)
+{
+	pid_t pid = __atomic_load_n(&s->health_pid, __ATOMIC_RELAXED);
+
+	if (!stats_pid_alive(pid) || !stats_pid_ours(pid))
+		return STATS_UNKNOWN;
+
+	return __atomic_load_n(&s->health, __ATOMIC_ACQUIRE);
+}
+
+/* Fail immediately when the keepalive process declared the port dead */
+void stats_check_health(void)
+{
+	char ago[16];
+
+	if (!stats || stats_health(stats) != STATS_DEAD)
+		return;
+
+	pr_err("%s is not responding (keepalive failed %s ago)\n", stats->dev,
+	       format_ns(ago, sizeof(ago), get_time_ns() -
+			 __atomic_load_n(&stats->health_time,
+					 __ATOMIC_RELAXED)));
+	exit(-1);
+}
+
+void stats_wait_begin(void)
+{
+	pid_t pid = getpid(), old;
+	unsigned int i;
+
+	if (!stats)
+		return;
+
+	// Claim a free slot, or one left behind by a process that died
+	for (i = 0; i < STATS_WAITERS; i++) {
+		old = __atomic_load_n(&stats->waiters[i], __ATOMIC_RELAXED);
+		if (old && stats_pid_alive(old))
+			continue;
+
+		if (__atomic_compare_exchange_n(&stats->waiters[i], &old, pid,
+						0, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			stats_waiter = i;
+			return;
+		}
+	}
+}
+
+void stats_wait_end(void)
+{
+	if (stats_waiter < 0)
+		return;
+
+	__atomic_store_n(&stats->waiters[stats_waiter], 0, __ATOMIC_RELAXED);
+	stats_waiter = -1;
+}
+
+static void stats_seq_inc(void)
+{
+	__atomic_fetch_add(&stats->seq, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void stats_busy_begin(void)
+{
+	if (!stats)
+		return;
+
+	stats_seq_inc();
+	stats->owner = getpid();
+	stats->busy_since = get_time_ns();
+	stats->cmd[0] = '\0';
+	stats_seq_inc();
+
+	stats_busy = 1;
+}
+
+void stats_cmd_begin(const char *cmd, size_t len)
+{
+	if (!stats_busy)
+		return;
+
+	while (len && (cmd[len - 1] == '\n' || cmd[len - 1] == '\r'))
+		len--;
+	if (len > sizeof(stats->cmd) - 1)
+		len = sizeof(stats->cmd) - 1;
+
+	stats_seq_inc();
+	memcpy(stats->cmd, cmd, len);
+	stats->cmd[len] = '\0';
+	stats_seq_inc();
+
+	stats_cmd = 1;
+}
+
+void stats_cmd_end(uint64_t latency_ns)
+{
+	if (!stats_cmd)
+		return;
+
+	// A responding device is alive, no matter what keepalive thinks
+	if (stats_health(stats) == STATS_DEAD)
+		__atomic_store_n(&stats->health, STATS_HEALTHY,
+				 __ATOMIC_RELEASE);
+
+	hist_add(&stats->latency, latency_ns);
+	__atomic_fetch_add(&stats->commands, 1, __ATOMIC_RELAXED);
+
+	stats_cmd = 0;
+}
+
+void stats_busy_end(void)
+{
+	uint64_t busy;
+
+	// A child sharing the session doesn't own the port
+	if (!stats_busy || stats->owner != getpid())
+		return;
+
+	busy = get_time_ns() - stats->busy_since;
+
+	stats_seq_inc();
+	stats->owner = 0;
+	stats->cmd[0] = '\0';
+	// Together with the owner, so readers never count it twice
+	__atomic_fetch_add(&stats->busy_ns, busy, __ATOMIC_RELAXED);
+	stats_seq_inc();
+
+	__atomic_store_n(&stats->last_used, get_time_ns(), __ATOMIC_RELAXED);
+
+	stats_busy = 0;
+}
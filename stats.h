@@ -0,0 +1,95 @@
+/*
+ *  Shared per-device statistics
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hist.h"
+
+#define MCUXEQ_STATS_ENV	"MCUXEQ_STATS"
+
+#define DEFAULT_STATS_DIR	"/dev/shm"
+#define STATS_PREFIX		"mcuxeq-"
+
+#define STATS_MAGIC		0x6d637873	/* "mcxs" */
+#define STATS_VERSION		2
+
+#define STATS_DEV_SIZE		PATH_MAX
+#define STATS_CMD_SIZE		64
+#define STATS_WAITERS		32
+
+/*
+ * One segment per serial port, shared by all mcuxeq processes using that
+ * port.  Counters are updated atomically; owner, command, and start time
+ * are only written by the lock holder, and protected by a sequence count.
+ */
+enum stats_health {
+	STATS_UNKNOWN,
+	STATS_HEALTHY,
+	STATS_DEAD,
+};
+
+struct stats {
+	uint32_t magic;
+	uint32_t version;
+	char dev[STATS_DEV_SIZE];
+
+	pid_t waiters[STATS_WAITERS];	/* Processes waiting for the lock */
+
+	uint32_t seq;
+	pid_t owner;			/* Lock holder, 0 if idle */
+	uint64_t busy_since;		/* Monotonic time of lock acquisition */
+	char cmd[STATS_CMD_SIZE];	/* Command being executed */
+
+	uint64_t busy_ns;		/* Total time the port was held */
+	uint64_t commands;		/* Completed commands */
+	uint64_t errors;		/* Failed commands */
+	struct hist latency;		/* Command to prompt latency in ns */
+
+	uint64_t last_used;		/* Monotonic time of lock release */
+	uint32_t health;		/* enum stats_health */
+	pid_t health_pid;		/* Keepalive process */
+	uint64_t health_time;		/* Monotonic time of last verdict */
+};
+
+struct stats_snapshot {
+	pid_t owner;
+	uint64_t busy_since;
+	uint64_t busy_ns;
+	char cmd[STATS_CMD_SIZE];
+};
+
+extern const char *stats_dir(void);
+extern int stats_name(char *buf, size_t size, const char *dev);
+extern int stats_valid(const struct stats *s);
+extern void stats_read(const struct stats *s, struct stats_snapshot *snap);
+extern unsigned int stats_queue_depth(const struct stats *s);
+extern int stats_pid_alive(pid_t pid);
+
+extern struct stats *stats_map(const char *dev);
+extern void stats_set_health(struct stats *s, enum stats_health health);
+extern enum stats_health stats_health(const struct stats *s);
+
+extern void stats_open(const char *dev);
+extern void stats_disable(void);
+extern void stats_check_health(void);
+extern void stats_wait_begin(void);
+extern void stats_wait_end(void);
+extern void stats_busy_begin(void);
+extern void stats_cmd_begin(const char *cmd, size_t len);
+extern void stats_cmd_end(uint64_t latency_ns);
+extern void stats_busy_end(void);
+
+extern int top_run(void);
+
+#endif /* STATS_H */
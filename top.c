@@ -0,0 +1,225 @@
+/*
+ *  Live monitor for shared serial ports
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mcuxeq.h"
+#include "stats.h"
+
+#define TOP_WINDOW_MS		5000
+#define TOP_MAX_DEVS		64
+
+struct top_sample {
+	uint64_t time;
+	uint64_t busy;
+	uint64_t commands;
+	uint64_t errors;
+	struct hist latency;
+};
+
+struct top_dev {
+	char name[NAME_MAX + 1];
+	const struct stats *stats;
+	struct top_sample *ring;
+	unsigned int head, used;
+};
+
+static struct top_dev top_devs[TOP_MAX_DEVS];
+static unsigned int top_ndevs;
+static unsigned int top_nsamples;
+
+static int top_known(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < top_ndevs; i++)
+		if (!strcmp(top_devs[i].name, name))
+			return 1;
+
+	return 0;
+}
+
+static void top_add(const char *dir, const char *name, const char *filter)
+{
+	struct top_dev *dev = &top_devs[top_ndevs];
+	char path[PATH_MAX];
+	struct stats *s;
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || st.st_size != sizeof(*s)) {
+		close(fd);
+		return;
+	}
+
+	s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+		return;
+
+	if (!stats_valid(s) || (filter && strcmp(s->dev, filter))) {
+		munmap(s, sizeof(*s));
+		return;
+	}
+
+	dev->ring = calloc(top_nsamples, sizeof(*dev->ring));
+	if (!dev->ring) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	dev->stats = s;
+	top_ndevs++;
+}
+
+static void top_scan(const char *filter)
+{
+	const char *dir = stats_dir();
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d) {
+		pr_err("Failed to open %s: %s\n", dir, strerror(errno));
+		exit(-1);
+	}
+
+	while ((de = readdir(d)) && top_ndevs < TOP_MAX_DEVS) {
+		if (strncmp(de->d_name, STATS_PREFIX, strlen(STATS_PREFIX)) ||
+		    top_known(de->d_name))
+			continue;
+
+		top_add(dir, de->d_name, filter);
+	}
+
+	closedir(d);
+}
+
+static void top_show(struct top_dev *dev, uint64_t now)
+{
+	const struct top_sample *cur, *old;
+	struct stats_snapshot snap;
+	static const char * const health[] = {
+		[STATS_UNKNOWN] = "-",
+		[STATS_HEALTHY] = "ok",
+		[STATS_DEAD] = "dead",
+	};
+	char p50[16], p99[16], owner[16];
+	struct top_sample *smp;
+	struct hist window;
+	uint64_t dt;
+
+	stats_read(dev->stats, &snap);
+
+	smp = &dev->ring[dev->head];
+	smp->time = now;
+	smp->busy = snap.busy_ns;
+	if (snap.owner && now > snap.busy_since)
+		smp->busy += now - snap.busy_since;
+	smp->commands = __atomic_load_n(&dev->stats->commands,
+					__ATOMIC_RELAXED);
+	smp->errors = __atomic_load_n(&dev->stats->errors, __ATOMIC_RELAXED);
+	hist_read(&smp->latency, &dev->stats->latency);
+
+	if (dev->used < top_nsamples)
+		dev->used++;
+	cur = smp;
+	old = &dev->ring[(dev->head + top_nsamples + 1 - dev->used) %
+			 top_nsamples];
+	dev->head = (dev->head + 1) % top_nsamples;
+
+	hist_sub(&window, &cur->latency, &old->latency);
+	if (hist_total(&window)) {
+		format_ns(p50, sizeof(p50), hist_quantile(&window, 500));
+		format_ns(p99, sizeof(p99), hist_quantile(&window, 990));
+	} else {
+		strcpy(p50, "-");
+		strcpy(p99, "-");
+	}
+
+	if (snap.owner)
+		snprintf(owner, sizeof(owner), "%d", snap.owner);
+	else
+		strcpy(owner, "-");
+
+	dt = cur->time - old->time;
+	printf("%-24s %-6s %5u %7s %6.1f %7.2f %8s %8s %5llu  %s\n",
+	       dev->stats->dev, health[stats_health(dev->stats)],
+	       stats_queue_depth(dev->stats), owner,
+	       dt ? 100.0 * (cur->busy - old->busy) / dt : 0.0,
+	       dt ? (double)NSEC_PER_SEC * (cur->commands - old->commands) / dt
+		  : 0.0,
+	       p50, p99, (unsigned long long)(cur->errors - old->errors),
+	       snap.cmd);
+}
+
+int top_run(void)
+{
+	char canon[PATH_MAX];
+	const char *filter = NULL;
+	int tty = isatty(STDOUT_FILENO);
+	unsigned int i;
+	uint64_t now;
+
+	if (opt_interval <= 0) {
+		pr_err("Invalid refresh interval %d\n", opt_interval);
+		exit(-1);
+	}
+
+	if (opt_dev)
+		filter = realpath(opt_dev, canon) ? canon : opt_dev;
+
+	top_nsamples = TOP_WINDOW_MS / opt_interval + 1;
+	if (top_nsamples < 2)
+		top_nsamples = 2;
+
+	// Emit each frame in one go
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+	while (1) {
+		top_scan(filter);
+		now = get_time_ns();
+
+		if (tty)
+			printf("\033[H\033[J");
+		printf("mcuxeq top - %u device%s, %d ms refresh, %u s window\n\n",
+		       top_ndevs, top_ndevs == 1 ? "" : "s", opt_interval,
+		       TOP_WINDOW_MS / 1000);
+		printf("%-24s %-6s %5s %7s %6s %7s %8s %8s %5s  %s\n",
+		       "DEVICE", "HEALTH", "QUEUE", "OWNER", "UTIL%", "CMD/S",
+		       "P50", "P99", "ERR", "COMMAND");
+
+		for (i = 0; i < top_ndevs; i++)
+			top_show(&top_devs[i], now);
+
+		if (!tty)
+			printf("\n");
+		fflush(stdout);
+
+		usleep(opt_interval * 1000);
+	}
+
+	return 0;
+}
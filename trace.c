@@ -0,0 +1,189 @@
+/*
+ *  Trace-event export of command lifecycles
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  Spans are written in the Chrome trace-event format (JSON array format,
+ *  which allows the closing bracket to be omitted), as complete ("X") events
+ *  with wall clock timestamps, so they can be shown on the same timeline as
+ *  spans from other tools, e.g. in Perfetto.  Each process is a separate
+ *  track, named after its device.
+ *
+ *  Events are buffered in memory, and appended to the file using a single
+ *  write when the buffer fills up, once per second, and at exit, so multiple
+ *  processes can share a file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mcuxeq.h"
+#include "trace.h"
+
+#define TRACE_FLUSH_SIZE	65536
+#define TRACE_FLUSH_NS		NSEC_PER_SEC
+
+static int trace_fd = -1;
+static pid_t trace_pid;		/* Current process, owner of the buffer */
+static char *trace_buf;
+static size_t trace_len, trace_size;
+static uint64_t trace_offset;	/* From monotonic to real time */
+static uint64_t trace_last_flush;
+static unsigned int trace_tid;	/* Track within the process */
+
+// Don't flush events buffered by the parent again after fork()
+static void trace_fork_child(void)
+{
+	trace_pid = getpid();
+	trace_len = 0;
+}
+
+static void trace_reserve(size_t len)
+{
+	if (trace_len + len <= trace_size)
+		return;
+
+	trace_size = trace_size ? trace_size * 2 : TRACE_FLUSH_SIZE * 2;
+	if (trace_size < trace_len + len)
+		trace_size = trace_len + len;
+	trace_buf = realloc(trace_buf, trace_size);
+	if (!trace_buf) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+}
+
+static void __attribute__ ((format (printf, 1, 2)))
+trace_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	trace_reserve(n + 1);
+
+	va_start(ap, fmt);
+	vsnprintf(trace_buf + trace_len, n + 1, fmt, ap);
+	va_end(ap);
+	trace_len += n;
+}
+
+/* Append a JSON string */
+static void trace_string(const char *s, size_t len)
+{
+	unsigned char c;
+	size_t i;
+
+	trace_reserve(2 + 6 * len);
+	trace_buf[trace_len++] = '"';
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if (c == '"' || c == '\\') {
+			trace_buf[trace_len++] = '\\';
+			trace_buf[trace_len++] = c;
+		} else if (c < 0x20) {
+			trace_len += sprintf(trace_buf + trace_len, "\\u%04x",
+					     c);
+		} else {
+			trace_buf[trace_len++] = c;
+		}
+	}
+	trace_buf[trace_len++] = '"';
+}
+
+void trace_flush(void)
+{
+	if (trace_fd < 0 || !trace_len)
+		return;
+
+	if (write(trace_fd, trace_buf, trace_len) != trace_len)
+		pr_err("Failed to write trace: %s\n", strerror(errno));
+	trace_len = 0;
+	trace_last_flush = get_time_ns();
+}
+
+void trace_open(const char *pathname)
+{
+	trace_fd = open(pathname, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+			0644);
+	if (trace_fd < 0) {
+		pr_err("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	trace_offset = get_realtime_ns() - get_time_ns();
+	trace_last_flush = get_time_ns();
+	trace_pid = getpid();
+	pthread_atfork(NULL, NULL, trace_fork_child);
+
+	// Before any events of forked children
+	if (!lseek(trace_fd, 0, SEEK_END)) {
+		trace_printf("[\n");
+		trace_flush();
+	}
+
+	atexit(trace_flush);
+}
+
+int trace_enabled(void)
+{
+	return trace_fd >= 0;
+}
+
+/* Name the track of the current process */
+void trace_process(const char *dev)
+{
+	if (trace_fd < 0)
+		return;
+
+	trace_printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		     "\"tid\":%d,\"args\":{\"name\":", trace_pid, trace_pid);
+	trace_string(dev, strlen(dev));
+	trace_printf("}},\n");
+}
+
+/* Select the track for overlapping spans, e.g. pipelined commands */
+void trace_lane(unsigned int lane)
+{
+	trace_tid = lane;
+}
+
+/* Add a span, with monotonic timestamps, and an optional command */
+void trace_span(const char *name, uint64_t start, uint64_t end,
+		const char *cmd, size_t len)
+{
+	if (trace_fd < 0)
+		return;
+
+	start += trace_offset;
+	end += trace_offset;
+	trace_printf("{\"name\":\"%s\",\"cat\":\"mcuxeq\",\"ph\":\"X\","
+		     "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%d,"
+		     "\"tid\":%d", name, start / NSEC_PER_USEC,
+		     start % NSEC_PER_USEC, (end - start) / NSEC_PER_USEC,
+		     (end - start) % NSEC_PER_USEC, trace_pid,
+		     trace_pid + trace_tid);
+	if (cmd) {
+		while (len && (cmd[len - 1] == '\n' || cmd[len - 1] == '\r'))
+			len--;
+		trace_printf(",\"args\":{\"cmd\":");
+		trace_string(cmd, len);
+		trace_printf("}");
+	}
+	trace_printf("},\n");
+
+	if (trace_len >= TRACE_FLUSH_SIZE ||
+	    end - trace_offset >= trace_last_flush + TRACE_FLUSH_NS)
+		trace_flush();
+}
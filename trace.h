@@ -0,0 +1,24 @@
+/*
+ *  Trace-event export of command lifecycles
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern void trace_open(const char *pathname);
+extern int trace_enabled(void);
+extern void trace_process(const char *dev);
+extern void trace_lane(unsigned int lane);
+extern void trace_span(const char *name, uint64_t start, uint64_t end,
+		       const char *cmd, size_t len);
+extern void trace_flush(void);
+
+#endif /* TRACE_H */
@@ -0,0 +1,817 @@
+/*
+ *  Decompression of compressed blocks in responses
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ *
+ *  Firmware can speed up bulk transfers by compressing them, and wrapping
+ *  them in base64 between marker lines:
+ *
+ *      -----BEGIN <algo>[ <params>]-----
+ *      <base64 data>
+ *      -----END <algo>-----
+ *
+ *  Supported algorithms are BASE64 (uncompressed), LZ4 (frame format, with
+ *  optional block and content checksums), and HEATSHRINK (optional
+ *  parameters: <window bits> <lookahead bits>, Default: 8 4).  Blocks are
+ *  decoded while they are received, through an unbuffered stream, using a
+ *  fixed-size window, so memory use does not depend on the size of the data.
+ *  Other lines are passed through unchanged.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mcuxeq.h"
+#include "digest.h"
+#include "unpack.h"
+
+#define UNPACK_LINE_SIZE	256
+#define UNPACK_WIN_SIZE		65536	/* LZ4 maximum offset + 1 */
+#define UNPACK_WIN_MASK		(UNPACK_WIN_SIZE - 1)
+#define UNPACK_DEC_SIZE		3072	/* Multiple of 3 */
+
+#define UNPACK_BEGIN		"-----BEGIN "
+#define UNPACK_END		"-----END "
+#define UNPACK_TRAILER		"-----"
+
+#define LZ4_MAGIC		0x184d2204
+#define LZ4_FLG_VERSION		0x40
+#define LZ4_FLG_BLOCK_CSUM	0x10
+#define LZ4_FLG_CONTENT_SIZE	0x08
+#define LZ4_FLG_CONTENT_CSUM	0x04
+#define LZ4_FLG_DICT_ID		0x01
+#define LZ4_UNCOMPRESSED	0x80000000
+
+#define HS_DEFAULT_WINDOW	8
+#define HS_DEFAULT_LOOKAHEAD	4
+
+enum unpack_mode {
+	UNPACK_TEXT,		/* Passing through lines */
+	UNPACK_DATA,		/* Decoding base64 data */
+	UNPACK_MARKER,		/* Collecting the end marker */
+};
+
+/* Block decoding states come last, see lz4_decode() */
+enum lz4_state {
+	LZ4_HDR_MAGIC,
+	LZ4_HDR_FLG,
+	LZ4_HDR_BD,
+	LZ4_SKIP,
+	LZ4_BLOCK_CSUM,
+	LZ4_CONTENT_CSUM,
+	LZ4_BLOCK_SIZE,
+	LZ4_RAW,
+	LZ4_TOKEN,
+	LZ4_LIT_LEN,
+	LZ4_LIT,
+	LZ4_OFFSET,
+	LZ4_MATCH_LEN,
+};
+
+enum hs_state {
+	HS_TAG,
+	HS_LIT,
+	HS_INDEX,
+	HS_COUNT,
+};
+
+struct unpack;
+
+struct unpack_algo {
+	const char *name;
+	int (*init)(struct unpack *u, const char *params);
+	int (*decode)(struct unpack *u, const uint8_t *buf, size_t len);
+	int (*done)(struct unpack *u);
+};
+
+struct unpack {
+	FILE *out;
+	enum unpack_mode mode;
+	const struct unpack_algo *algo;
+	int error;
+
+	char line[UNPACK_LINE_SIZE];
+	size_t line_len;
+	int line_pass;		/* Passing through a long line */
+	int bol;		/* At the beginning of a line of data */
+
+	uint32_t b64;		/* Pending sextets */
+	unsigned int b64_n;
+
+	uint8_t win[UNPACK_WIN_SIZE];
+	uint64_t pos;		/* Total bytes decoded */
+	uint64_t flushed;	/* Total bytes written */
+	uint64_t start;		/* Position of the current block */
+	struct xxh32 *hash;	/* Hashing the output, if set */
+
+	union {
+		struct {
+			enum lz4_state state;
+			enum lz4_state next;	/* After LZ4_SKIP */
+			uint32_t val;
+			unsigned int cnt;
+			unsigned int skip;
+			uint8_t flg;
+			uint32_t block_left;
+			size_t lit, match;
+			unsigned int frames;
+			struct xxh32 block_xxh, content_xxh;
+		} lz4;
+		struct {
+			enum hs_state state;
+			unsigned int window, lookahead;
+			uint32_t bits;
+			unsigned int nbits;
+			uint32_t index;
+		} hs;
+	};
+
+	unsigned long long blocks, in_bytes;
+};
+
+static uint8_t b64_table[256];
+
+#define B64_INVALID	0xff
+#define B64_PAD		0xfe
+#define B64_SPACE	0xfd
+
+static void b64_init(void)
+{
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned int i;
+
+	memset(b64_table, B64_INVALID, sizeof(b64_table));
+	for (i = 0; i < 64; i++)
+		b64_table[(uint8_t)alphabet[i]] = i;
+	b64_table['='] = B64_PAD;
+	b64_table[' '] = b64_table['\t'] = b64_table['\r'] = B64_SPACE;
+}
+
+static int unpack_flush(struct unpack *u)
+{
+	size_t n = u->pos - u->flushed;
+	const uint8_t *p;
+
+	if (!n)
+		return 0;
+
+	// Contiguous, as unpack_put() flushes when wrapping
+	p = u->win + (u->flushed & UNPACK_WIN_MASK);
+	if (fwrite(p, 1, n, u->out) != n)
+		return -1;
+	if (u->hash)
+		xxh32_update(u->hash, p, n);
+	u->flushed = u->pos;
+
+	return 0;
+}
+
+static inline int unpack_put(struct unpack *u, uint8_t c)
+{
+	u->win[u->pos++ & UNPACK_WIN_MASK] = c;
+	if (!(u->pos & UNPACK_WIN_MASK))
+		return unpack_flush(u);
+
+	return 0;
+}
+
+/* Copy a match, reading zeroes before the start of the block */
+static int unpack_copy(struct unpack *u, uint32_t offset, size_t len)
+{
+	uint8_t c;
+
+	while (len--) {
+		c = offset > u->pos - u->start ? 0 :
+		    u->win[(u->pos - offset) & UNPACK_WIN_MASK];
+		if (unpack_put(u, c))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Uncompressed */
+
+static int raw_decode(struct unpack *u, const uint8_t *buf, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = UNPACK_WIN_SIZE - (u->pos & UNPACK_WIN_MASK);
+		if (n > len)
+			n = len;
+		memcpy(u->win + (u->pos & UNPACK_WIN_MASK), buf, n);
+		u->pos += n;
+		buf += n;
+		len -= n;
+		if (!(u->pos & UNPACK_WIN_MASK) && unpack_flush(u))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* LZ4 frame format, with linked or independent blocks */
+
+static int lz4_init(struct unpack *u, const char *params)
+{
+	memset(&u->lz4, 0, sizeof(u->lz4));
+
+	return 0;
+}
+
+/* Collect a little-endian field, returns non-zero when complete */
+static int lz4_field(struct unpack *u, uint8_t c, unsigned int size)
+{
+	u->lz4.val |= (uint32_t)c << (8 * u->lz4.cnt);
+	if (++u->lz4.cnt < size)
+		return 0;
+
+	u->lz4.cnt = 0;
+	return 1;
+}
+
+static void lz4_skip(struct unpack *u, unsigned int n, enum lz4_state next)
+{
+	u->lz4.skip = n;
+	u->lz4.next = next;
+	u->lz4.state = n ? LZ4_SKIP : next;
+}
+
+static int lz4_decode(struct unpack *u, const uint8_t *buf, size_t len)
+{
+	const uint8_t *block = NULL;	/* Start of checksummed block data */
+	uint32_t offset;
+	int in_block;
+	uint8_t c;
+
+	while (len--) {
+		c = *buf++;
+		in_block = u->lz4.state >= LZ4_RAW;
+		if (in_block && !block && u->lz4.flg & LZ4_FLG_BLOCK_CSUM)
+			block = buf - 1;
+
+		switch (u->lz4.state) {
+		case LZ4_HDR_MAGIC:
+			if (!lz4_field(u, c, 4))
+				break;
+			if (u->lz4.val != LZ4_MAGIC)
+				return -1;
+			u->lz4.val = 0;
+			u->lz4.state = LZ4_HDR_FLG;
+			break;
+
+		case LZ4_HDR_FLG:
+			if ((c & 0xc0) != LZ4_FLG_VERSION)
+				return -1;
+			u->lz4.flg = c;
+			u->lz4.state = LZ4_HDR_BD;
+			if (!(c & LZ4_FLG_CONTENT_CSUM))
+				break;
+			// Hash the output of this frame only
+			if (unpack_flush(u))
+				return -1;
+			xxh32_init(&u->lz4.content_xxh);
+			u->hash = &u->lz4.content_xxh;
+			break;
+
+		case LZ4_HDR_BD:
+			// Content size, dictionary ID, and header checksum
+			lz4_skip(u, (u->lz4.flg & LZ4_FLG_CONTENT_SIZE ? 8 : 0) +
+				    (u->lz4.flg & LZ4_FLG_DICT_ID ? 4 : 0) + 1,
+				 LZ4_BLOCK_SIZE);
+			break;
+
+		case LZ4_SKIP:
+			if (!--u->lz4.skip)
+				u->lz4.state = u->lz4.next;
+			break;
+
+		case LZ4_BLOCK_CSUM:
+			if (!lz4_field(u, c, 4))
+				break;
+			if (u->lz4.val != xxh32_final(&u->lz4.block_xxh))
+				return -1;
+			u->lz4.val = 0;
+			u->lz4.state = LZ4_BLOCK_SIZE;
+			break;
+
+		case LZ4_CONTENT_CSUM:
+			if (!lz4_field(u, c, 4))
+				break;
+			if (u->lz4.val != xxh32_final(&u->lz4.content_xxh))
+				return -1;
+			u->hash = NULL;
+			u->lz4.val = 0;
+			u->lz4.state = LZ4_HDR_MAGIC;
+			break;
+
+		case LZ4_BLOCK_SIZE:
+			if (!lz4_field(u, c, 4))
+				break;
+			u->lz4.block_left = u->lz4.val & ~LZ4_UNCOMPRESSED;
+			if (!u->lz4.val) {
+				// End mark
+				u->lz4.frames++;
+				u->lz4.state = LZ4_HDR_MAGIC;
+				if (u->lz4.flg & LZ4_FLG_CONTENT_CSUM) {
+					if (unpack_flush(u))
+						return -1;
+					u->lz4.state = LZ4_CONTENT_CSUM;
+				}
+			} else if (!u->lz4.block_left) {
+				return -1;
+			} else {
+				if (u->lz4.flg & LZ4_FLG_BLOCK_CSUM)
+					xxh32_init(&u->lz4.block_xxh);
+				u->lz4.state = u->lz4.val & LZ4_UNCOMPRESSED ?
+					       LZ4_RAW : LZ4_TOKEN;
+			}
+			u->lz4.val = 0;
+			break;
+
+		case LZ4_RAW:
+			if (unpack_put(u, c))
+				return -1;
+			break;
+
+		case LZ4_TOKEN:
+			u->lz4.lit = c >> 4;
+			u->lz4.match = c & 15;
+			u->lz4.state = u->lz4.lit == 15 ? LZ4_LIT_LEN :
+				       u->lz4.lit ? LZ4_LIT : LZ4_OFFSET;
+			break;
+
+		case LZ4_LIT_LEN:
+			u->lz4.lit += c;
+			if (c != 255)
+				u->lz4.state = LZ4_LIT;
+			break;
+
+		case LZ4_LIT:
+			if (unpack_put(u, c))
+				return -1;
+			if (!--u->lz4.lit)
+				u->lz4.state = LZ4_OFFSET;
+			break;
+
+		case LZ4_OFFSET:
+			if (!lz4_field(u, c, 2))
+				break;
+			offset = u->lz4.val;
+			if (!offset || offset > u->pos - u->start)
+				return -1;
+			if (u->lz4.match == 15) {
+				u->lz4.state = LZ4_MATCH_LEN;
+				break;
+			}
+			if (unpack_copy(u, offset, u->lz4.match + 4))
+				return -1;
+			u->lz4.val = 0;
+			u->lz4.state = LZ4_TOKEN;
+			break;
+
+		case LZ4_MATCH_LEN:
+			u->lz4.match += c;
+			if (c == 255)
+				break;
+			if (unpack_copy(u, u->lz4.val, u->lz4.match + 4))
+				return -1;
+			u->lz4.val = 0;
+			u->lz4.state = LZ4_TOKEN;
+			break;
+		}
+
+		if (!in_block || --u->lz4.block_left)
+			continue;
+
+		// The last sequence of a block has literals only
+		if (u->lz4.state != LZ4_RAW &&
+		    (u->lz4.state != LZ4_OFFSET || u->lz4.cnt))
+			return -1;
+		u->lz4.state = LZ4_BLOCK_SIZE;
+		if (block) {
+			xxh32_update(&u->lz4.block_xxh, block, buf - block);
+			block = NULL;
+			u->lz4.state = LZ4_BLOCK_CSUM;
+		}
+	}
+
+	// The rest of the block follows in the next call
+	if (block)
+		xxh32_update(&u->lz4.block_xxh, block, buf - block);
+
+	return 0;
+}
+
+static int lz4_done(struct unpack *u)
+{
+	return u->lz4.frames && u->lz4.state == LZ4_HDR_MAGIC &&
+	       !u->lz4.cnt;
+}
+
+/* Heatshrink (LZSS), as produced by heatshrink_encoder */
+
+static int hs_init(struct unpack *u, const char *params)
+{
+	unsigned int window = HS_DEFAULT_WINDOW;
+	unsigned int lookahead = HS_DEFAULT_LOOKAHEAD;
+
+	if (*params && sscanf(params, "%u %u", &window, &lookahead) != 2)
+		return -1;
+	if (window < 4 || window > 15 || lookahead < 3 || lookahead >= window)
+		return -1;
+
+	memset(&u->hs, 0, sizeof(u->hs));
+	u->hs.window = window;
+	u->hs.lookahead = lookahead;
+
+	return 0;
+}
+
+static int hs_decode(struct unpack *u, const uint8_t *buf, size_t len)
+{
+	unsigned int need;
+	uint32_t val;
+
+	while (len--) {
+		u->hs.bits = (u->hs.bits << 8) | *buf++;
+		u->hs.nbits += 8;
+
+		while (1) {
+			switch (u->hs.state) {
+			case HS_TAG:
+				need = 1;
+				break;
+			case HS_LIT:
+				need = 8;
+				break;
+			case HS_INDEX:
+				need = u->hs.window;
+				break;
+			default:
+				need = u->hs.lookahead;
+				break;
+			}
+			if (u->hs.nbits < need)
+				break;
+
+			u->hs.nbits -= need;
+			val = (u->hs.bits >> u->hs.nbits) & ((1U << need) - 1);
+
+			switch (u->hs.state) {
+			case HS_TAG:
+				u->hs.state = val ? HS_LIT : HS_INDEX;
+				break;
+			case HS_LIT:
+				if (unpack_put(u, val))
+					return -1;
+				u->hs.state = HS_TAG;
+				break;
+			case HS_INDEX:
+				u->hs.index = val + 1;
+				u->hs.state = HS_COUNT;
+				break;
+			case HS_COUNT:
+				if (unpack_copy(u, u->hs.index, val + 1))
+					return -1;
+				u->hs.state = HS_TAG;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int hs_done(struct unpack *u)
+{
+	// The last byte is padded with zero bits
+	return u->hs.nbits < 8;
+}
+
+static const struct unpack_algo unpack_algos[] = {
+	{ "BASE64", NULL, raw_decode, NULL },
+	{ "LZ4", lz4_init, lz4_decode, lz4_done },
+	{ "HEATSHRINK", hs_init, hs_decode, hs_done },
+};
+
+static struct unpack *unpack;
+
+static int unpack_fail(struct unpack *u, const char *what)
+{
+	pr_err("%s %s data\n", what, u->algo->name);
+	u->error = 1;
+	u->mode = UNPACK_TEXT;
+	u->line_len = 0;
+	errno = EBADMSG;
+
+	return -1;
+}
+
+/* Returns non-zero if the line is a begin marker */
+static int unpack_begin(struct unpack *u, const char *buf, size_t len)
+{
+	char line[UNPACK_LINE_SIZE], *name, *params;
+	unsigned int i;
+	size_t n;
+
+	while (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+		len--;
+	memcpy(line, buf, len);
+	line[len] = '\0';
+
+	n = strlen(UNPACK_BEGIN);
+	if (len <= n + strlen(UNPACK_TRAILER) ||
+	    strncmp(line, UNPACK_BEGIN, n) ||
+	    strcmp(line + len - strlen(UNPACK_TRAILER), UNPACK_TRAILER))
+		return 0;
+
+	name = line + n;
+	line[len - strlen(UNPACK_TRAILER)] = '\0';
+	params = name + strcspn(name, " ");
+	if (*params)
+		*params++ = '\0';
+
+	for (i = 0; i < sizeof(unpack_algos) / sizeof(*unpack_algos); i++)
+		if (!strcasecmp(unpack_algos[i].name, name))
+			break;
+	if (i == sizeof(unpack_algos) / sizeof(*unpack_algos))
+		return 0;
+
+	u->algo = &unpack_algos[i];
+	if (u->algo->init && u->algo->init(u, params)) {
+		pr_err("Invalid %s parameters \"%s\"\n", u->algo->name, params);
+		u->error = 1;
+		return 0;
+	}
+
+	pr_debug("Start of %s block\n", u->algo->name);
+	u->mode = UNPACK_DATA;
+	u->bol = 1;
+	u->b64 = 0;
+	u->b64_n = 0;
+	u->start = u->pos;
+	u->hash = NULL;
+	u->blocks++;
+
+	return 1;
+}
+
+static int unpack_end(struct unpack *u)
+{
+	char *line = u->line;
+
+	line[u->line_len] = '\0';
+	if (strncmp(line, UNPACK_END, strlen(UNPACK_END)))
+		return unpack_fail(u, "Corrupt");
+
+	if (u->algo->done && !u->algo->done(u))
+		return unpack_fail(u, "Truncated");
+
+	if (unpack_flush(u))
+		return -1;
+
+	pr_debug("End of %s block, %llu bytes\n", u->algo->name,
+		 (unsigned long long)(u->pos - u->start));
+	u->mode = UNPACK_TEXT;
+	u->line_len = 0;
+
+	return 0;
+}
+
+/* Decode base64, returns the number of bytes consumed, or -1 on error */
+static ssize_t unpack_data(struct unpack *u, const uint8_t *buf, size_t len)
+{
+	uint8_t dec[UNPACK_DEC_SIZE];
+	size_t i = 0, n = 0;
+	uint32_t v;
+	uint8_t c;
+
+	while (i < len && n <= sizeof(dec) - 3) {
+		// Fast path: a group of four characters
+		if (!u->b64_n && i + 4 <= len) {
+			v = b64_table[buf[i]] | b64_table[buf[i + 1]] |
+			    b64_table[buf[i + 2]] | b64_table[buf[i + 3]];
+			if (v < 64) {
+				v = b64_table[buf[i]] << 18 |
+				    b64_table[buf[i + 1]] << 12 |
+				    b64_table[buf[i + 2]] << 6 |
+				    b64_table[buf[i + 3]];
+				dec[n++] = v >> 16;
+				dec[n++] = v >> 8;
+				dec[n++] = v;
+				i += 4;
+				u->bol = 0;
+				continue;
+			}
+		}
+
+		c = buf[i];
+		if (c == '\n') {
+			u->bol = 1;
+			i++;
+			continue;
+		}
+		if (c == '-' && u->bol) {
+			u->mode = UNPACK_MARKER;
+			break;
+		}
+		u->bol = 0;
+		i++;
+
+		switch (v = b64_table[c]) {
+		case B64_SPACE:
+			break;
+
+		case B64_PAD:
+			if (u->b64_n == 2) {
+				dec[n++] = u->b64 >> 4;
+			} else if (u->b64_n == 3) {
+				dec[n++] = u->b64 >> 10;
+				dec[n++] = u->b64 >> 2;
+			}
+			u->b64 = 0;
+			u->b64_n = 0;
+			break;
+
+		case B64_INVALID:
+			n = 0;
+			goto fail;
+
+		default:
+			u->b64 = (u->b64 << 6) | v;
+			if (++u->b64_n < 4)
+				break;
+			dec[n++] = u->b64 >> 16;
+			dec[n++] = u->b64 >> 8;
+			dec[n++] = u->b64;
+			u->b64 = 0;
+			u->b64_n = 0;
+			break;
+		}
+	}
+
+	// Unpadded end of data
+	if (u->mode == UNPACK_MARKER && u->b64_n >= 2) {
+		dec[n++] = u->b64 >> (u->b64_n == 2 ? 4 : 10);
+		if (u->b64_n == 3)
+			dec[n++] = u->b64 >> 2;
+		u->b64_n = 0;
+	}
+
+	u->in_bytes += n;
+	if (!u->algo->decode(u, dec, n))
+		return i;
+
+fail:
+	if (ferror(u->out))
+		return -1;
+	return unpack_fail(u, "Corrupt");
+}
+
+/* Collect the current line, returns the number of bytes consumed */
+static size_t unpack_line(struct unpack *u, const char *buf, size_t len)
+{
+	const char *nl = memchr(buf, '\n', len);
+	size_t n = nl ? nl - buf + 1 : len;
+
+	if (n > sizeof(u->line) - 1 - u->line_len)
+		n = sizeof(u->line) - 1 - u->line_len;
+	memcpy(u->line + u->line_len, buf, n);
+	u->line_len += n;
+
+	return n;
+}
+
+static ssize_t unpack_write(void *cookie, const char *buf, size_t len)
+{
+	struct unpack *u = cookie;
+	size_t i = 0, n;
+	const char *nl;
+	ssize_t res;
+	int eol;
+
+	while (i < len) {
+		switch (u->mode) {
+		case UNPACK_TEXT:
+			if (u->line_pass) {
+				// Rest of a long line
+				nl = memchr(buf + i, '\n', len - i);
+				n = nl ? nl - (buf + i) + 1 : len - i;
+				if (fwrite(buf + i, 1, n, u->out) != n)
+					goto fail;
+				u->line_pass = !nl;
+				i += n;
+				break;
+			}
+
+			n = unpack_line(u, buf + i, len - i);
+			i += n;
+			eol = u->line[u->line_len - 1] == '\n';
+			if (!eol && u->line_len < sizeof(u->line) - 1)
+				break;
+
+			if (!unpack_begin(u, u->line, u->line_len)) {
+				if (fwrite(u->line, 1, u->line_len, u->out) !=
+				    u->line_len)
+					goto fail;
+				u->line_pass = !eol;
+			}
+			u->line_len = 0;
+			break;
+
+		case UNPACK_DATA:
+			res = unpack_data(u, (const uint8_t *)buf + i, len - i);
+			if (res < 0)
+				goto fail;
+			i += res;
+			break;
+
+		case UNPACK_MARKER:
+			n = unpack_line(u, buf + i, len - i);
+			i += n;
+			if (u->line[u->line_len - 1] != '\n' &&
+			    u->line_len < sizeof(u->line) - 1)
+				break;
+			if (unpack_end(u))
+				goto fail;
+			break;
+		}
+	}
+
+	// Don't hold back decoded data, e.g. of compressed logs
+	if (u->mode != UNPACK_TEXT && unpack_flush(u))
+		goto fail;
+
+	return len;
+
+fail:
+	// The command will be stopped, resynchronize with the next one
+	u->mode = UNPACK_TEXT;
+	u->line_len = 0;
+	u->line_pass = 0;
+
+	// Not -1, which fwrite() adds to the number of bytes written
+	return 0;
+}
+
+/*
+ * Returns an unbuffered stream, writing data written to it to out, with
+ * compressed blocks decoded
+ */
+FILE *unpack_open(FILE *out)
+{
+	cookie_io_functions_t io = { .write = unpack_write };
+	FILE *f;
+
+	b64_init();
+
+	unpack = calloc(1, sizeof(*unpack));
+	if (!unpack) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	unpack->out = out;
+
+	f = fopencookie(unpack, "w", io);
+	if (!f) {
+		pr_err("Failed to allocate buffer: %s\n", strerror(errno));
+		exit(-1);
+	}
+	setvbuf(f, NULL, _IONBF, 0);
+
+	return f;
+}
+
+/* Returns zero if all blocks were decoded successfully */
+int unpack_close(FILE *f)
+{
+	struct unpack *u = unpack;
+	int res;
+
+	fclose(f);
+	unpack = NULL;
+
+	if (u->mode == UNPACK_TEXT && u->line_len)
+		fwrite(u->line, 1, u->line_len, u->out);
+	if (u->mode != UNPACK_TEXT)
+		unpack_fail(u, "Unterminated");
+
+	pr_debug("Decoded %llu blocks, %llu bytes from %llu bytes\n",
+		 u->blocks, (unsigned long long)u->pos, u->in_bytes);
+
+	res = u->error;
+	free(u);
+
+	return res;
+}
@@ -0,0 +1,18 @@
+/*
+ *  Decompression of compressed blocks in responses
+ *
+ *  (C) Copyright 2024 Geert Uytterhoeven
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License.
+ */
+
+#ifndef UNPACK_H
+#define UNPACK_H
+
+#include <stdio.h>
+
+extern FILE *unpack_open(FILE *out);
+extern int unpack_close(FILE *f);
+
+#endif /* UNPACK_H */